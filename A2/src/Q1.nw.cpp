@@ -20,26 +20,28 @@ bool neighbors_le(const int& y, const int& x, const cv::Mat& I, const int& q) {
   return false;
 }
 
-@ The second convenience function [[neighbors_ge]] returns a set $\left\{(y',x') \mid I_{y',x'} \in N_8(I_{y,x}) \land I_{y',x'} \geq q\right\}$.
+@ The second convenience function [[neighbors_ge]] appends the set $\left\{(y',x') \mid I_{y',x'} \in N_8(I_{y,x}) \land I_{y',x'} \geq q\right\}$ to a boundary.
+Boundaries are stored as flat vectors of linear pixel indices $y \cdot W + x$, and a [[queued]] bitmap with one entry per pixel keeps each pixel from being added more than once.
 This function is used in [[grassfire]] on the distances matrix $D$ to determine the next boundary from the current boundary.
 
 <<Convenience Functions>>=
-template <typename T_in, typename T_out=uint16_t>
-std::set<std::pair<T_out, T_out> > neighbors_ge(const int& y, const int& x,
-                                                const cv::Mat& I, const int& q) {
+template <typename T>
+void neighbors_ge(const int& y, const int& x, const cv::Mat& I, const int& q,
+                  std::vector<uint8_t>* queued, std::vector<int>* boundary) {
   cv::Size size = I.size();
-  std::set<std::pair<T_out, T_out> > neighbors;
   for (int i = std::max(0, y-1); i <= std::min(y+1, size.height-1); ++i) {
     for (int j = std::max(0, x-1); j <= std::min(x+1, size.width-1); ++j) {
-      if (I.at<T_in>(i, j) >= q) {
-        neighbors.insert(std::make_pair(i, j));
+      int index = i * size.width + j;
+      if (I.at<T>(i, j) >= q && !(*queued)[index]) {
+        (*queued)[index] = 1;
+        boundary->push_back(index);
       }
     }
   }
-  return neighbors;
 }
 
 @ The third convenience function [[neighbors_bend]] compares the average of the surrounding pixels to the pixel of interest.
+The sum is accumulated in double precision so the function also works on the fractional distances of the Euclidean transform described later.
 If the pixel of interest is larger than the average of its neighbors in the distances matrix $D$, it is considered part of the skeleton because it is likely a collision of wavefronts in the grassfire transform.
 To improve robustness to noise, pixels with a distance smaller than a constant [[NOISE_DIST]] are excluded from the skeleton.
 <<Convenience Functions>>=
@@ -52,8 +54,8 @@ bool neighbors_bend(const int& y, const int& x, const cv::Mat& I) {
     return false;
 
   cv::Size size = I.size();
-  int sum = 0,
-      count = 0;
+  double sum = 0;
+  int count = 0;
   for (int i = std::max(0, y-1); i <= std::min(y+1, size.height-1); ++i) {
     for (int j = std::max(0, x-1); j <= std::min(x+1, size.width-1); ++j) {
       if (i != y || j != x) {
@@ -102,21 +104,24 @@ Next, the grassfire transform is defined in Algorithm \ref{alg:grassfire} and th
 \end{algorithmic}
 \end{algorithm}
 
+The boundaries $B$ are kept in two vectors which are swapped after each wave and cleared without releasing their memory, so no allocation happens once they have grown to the size of the largest wavefront.
+Since every pixel is queued at most once, the transform runs in time linear in the number of pixels.
+
 <<[[grassfire]] function>>=
 template<typename T_in, typename T_out=uint16_t>
-cv::Mat_<T_out> grassfire(cv::Mat I) {
+cv::Mat_<T_out> grassfire_wavefront(cv::Mat I) {
   T_out max_val = std::numeric_limits<T_out>::max();
   cv::Size size = I.size();
   cv::Mat_<T_out> D(size, max_val);
-  std::set<std::pair<T_out, T_out> > *B = new std::set<std::pair<T_out, T_out> >();
+  std::vector<uint8_t> queued(size.area(), 0);
+  std::vector<int> B, new_B;
   for (int i = 0; i < size.height; ++i) {
     for (int j = 0; j < size.width; ++j) {
       if (I.at<T_in>(i, j) > 0) {
         if (neighbors_le<T_in>(i, j, I, 0)) {
           // Not black but has black neighbors -> B
           D(i, j) = 1;
-          std::set<std::pair<T_out, T_out> > B_update = neighbors_ge<T_in>(i, j, I, 1);
-          B->insert(B_update.begin(), B_update.end());
+          neighbors_ge<T_in>(i, j, I, 1, &queued, &B);
         }
       } else {
         // Interior pixel
@@ -126,20 +131,208 @@ cv::Mat_<T_out> grassfire(cv::Mat I) {
   }
 
   T_out n = 2;
-  while (!B->empty()) {
-    std::set<std::pair<T_out, T_out> > *new_B = new std::set<std::pair<T_out, T_out> >();
-    for (auto&& B_pt : *B) {
-      D(B_pt.first, B_pt.second) = n;
+  while (!B.empty()) {
+    for (int B_pt : B) {
+      D(B_pt / size.width, B_pt % size.width) = n;
     }
-    for (auto&& B_pt : *B) {
-      std::set<std::pair<T_out, T_out> > update
-          = neighbors_ge<T_out>(B_pt.first, B_pt.second, D, max_val);
-      new_B->insert(update.begin(), update.end());
+    for (int B_pt : B) {
+      neighbors_ge<T_out>(B_pt / size.width, B_pt % size.width, D, max_val,
+                          &queued, &new_B);
     }
     ++n;
-    delete B;  B = new_B;
+    std::swap(B, new_B);
+    new_B.clear();
+  }
+
+  return D;
+}
+
+@ \subsection*{Two-Pass Grassfire Transform}
+
+The wavefront propagation above labels each foreground pixel with its chessboard ($N_8$) distance $d$ to the nearest background pixel, except that the first boundary is relabelled by the first wave, so pixels with $d = 1$ end with $D = 2$.
+The same map can be computed without a frontier by the classic two raster passes.
+The forward pass visits pixels from top-left to bottom-right and takes the minimum over the four neighbors already visited, $d_{y,x} \gets \min(d_{y,x}, d_{y',x'} + 1)$; the backward pass does the same from bottom-right to top-left with the other four neighbors.
+Every path to the nearest background pixel is covered by one of the two passes, so after both passes $d$ is exactly the chessboard distance.
+Both passes are simple row scans over contiguous memory which the compiler can vectorize.
+
+The passes run in [[two_pass_labels]], which then maps $d$ to the labels of [[grassfire_wavefront]]: background is 0, $d \leq 2$ becomes 2, and foreground with no background in the image keeps the maximum value of [[T_out]].
+The result is bit-identical to [[grassfire_wavefront]].
+The [[grassfire_two_pass]] function sets the initial distances from the image, infinite on the foreground and zero on the background.
+
+<<[[grassfire]] function>>=
+const int GRASSFIRE_INF = std::numeric_limits<int>::max() - 1;
+
+template<typename T_out>
+cv::Mat_<T_out> two_pass_labels(cv::Mat_<int>& d) {
+  const int inf = GRASSFIRE_INF;
+  T_out max_val = std::numeric_limits<T_out>::max();
+  cv::Size size = d.size();
+
+  for (int i = 0; i < size.height; ++i) {
+    for (int j = 0; j < size.width; ++j) {
+      int dist = d(i, j);
+      if (i > 0) {
+        dist = std::min(dist, d(i-1, j) + 1);
+        if (j > 0)
+          dist = std::min(dist, d(i-1, j-1) + 1);
+        if (j < size.width - 1)
+          dist = std::min(dist, d(i-1, j+1) + 1);
+      }
+      if (j > 0)
+        dist = std::min(dist, d(i, j-1) + 1);
+      d(i, j) = dist;
+    }
+  }
+
+  for (int i = size.height - 1; i >= 0; --i) {
+    for (int j = size.width - 1; j >= 0; --j) {
+      int dist = d(i, j);
+      if (i < size.height - 1) {
+        dist = std::min(dist, d(i+1, j) + 1);
+        if (j > 0)
+          dist = std::min(dist, d(i+1, j-1) + 1);
+        if (j < size.width - 1)
+          dist = std::min(dist, d(i+1, j+1) + 1);
+      }
+      if (j < size.width - 1)
+        dist = std::min(dist, d(i, j+1) + 1);
+      d(i, j) = dist;
+    }
   }
 
+  cv::Mat_<T_out> D(size);
+  for (int i = 0; i < size.height; ++i) {
+    for (int j = 0; j < size.width; ++j) {
+      int dist = d(i, j);
+      if (dist >= inf || dist >= max_val)
+        D(i, j) = max_val;
+      else if (dist == 0)
+        D(i, j) = 0;
+      else
+        D(i, j) = std::max(dist, 2);
+    }
+  }
+  return D;
+}
+
+template<typename T_in, typename T_out=uint16_t>
+cv::Mat_<T_out> grassfire_two_pass(cv::Mat I) {
+  cv::Mat_<int> d(I.size());
+  for (int i = 0; i < d.rows; ++i) {
+    for (int j = 0; j < d.cols; ++j) {
+      d(i, j) = (I.at<T_in>(i, j) > 0) ? GRASSFIRE_INF : 0;
+    }
+  }
+  return two_pass_labels<T_out>(d);
+}
+
+@ The [[grassfire]] function selects between the two implementations with [[GrassfireEngine]].
+The two-pass engine is the default since it produces the same result without any frontier.
+
+<<[[grassfire]] function>>=
+enum GrassfireEngine {
+  WAVEFRONT = 0,
+  TWO_PASS = 1
+};
+
+template<typename T_in, typename T_out=uint16_t>
+cv::Mat_<T_out> grassfire(cv::Mat I, GrassfireEngine engine=GrassfireEngine::TWO_PASS) {
+  if (engine == GrassfireEngine::WAVEFRONT)
+    return grassfire_wavefront<T_in, T_out>(I);
+  return grassfire_two_pass<T_in, T_out>(I);
+}
+
+@ A binary image stored as a [[PackedMask]] is read directly by the two-pass engine, setting the initial distances a byte of eight pixels at a time.
+The transform itself still needs a full image of distances, so the mask only saves memory while it is stored or handed between stages, not while [[grassfire]] runs.
+The [[main]] function and its batch mode pack their input with [[pack_mask]] and use this overload.
+
+<<[[grassfire]] function>>=
+template<typename T_out=uint16_t>
+cv::Mat_<T_out> grassfire(const PackedMask& mask) {
+  cv::Mat_<int> d(mask.size());
+  parallel_rows(mask.rows, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      const uint8_t* bits = mask.row(i);
+      int* row = d[i];
+      for (int j = 0; j < mask.cols; ++j)
+        row[j] = ((bits[j >> 3] >> (j & 7)) & 1) ? GRASSFIRE_INF : 0;
+    }
+  });
+  return two_pass_labels<T_out>(d);
+}
+
+@ \subsection*{Euclidean Grassfire Transform}
+
+Chessboard distances grow equally fast along diagonals and axes, which is why [[neighbors_bend]] produces jagged skeletons along diagonals.
+The [[grassfire_euclidean]] function instead computes the exact Euclidean distance from each pixel to the nearest background pixel using the separable algorithm of Felzenszwalb and Huttenlocher.
+The squared distance transform is computed by [[edt_1d]] first along each column and then along each row of the column result.
+In one dimension, the squared distance $\min_{q'} \left((q - q')^2 + f(q')\right)$ is the lower envelope of parabolas rooted at each $q'$, which is built in a single left-to-right sweep where [[v]] holds the roots of the parabolas in the envelope and [[z]] holds the boundaries between them.
+Foreground pixels start with the large finite value [[EDT_INF]] rather than infinity so the intersection arithmetic stays finite.
+Foreground with no background in the image is given the maximum value of [[T_out]].
+
+<<[[grassfire]] function>>=
+const double EDT_INF = 1e20;
+
+void edt_1d(const std::vector<double>& f, std::vector<double>* d,
+            std::vector<int>* v, std::vector<double>* z) {
+  const int n = f.size();
+  int k = 0;
+  (*v)[0] = 0;
+  (*z)[0] = -EDT_INF;
+  (*z)[1] = EDT_INF;
+  for (int q = 1; q < n; ++q) {
+    double s;
+    while (true) {
+      int r = (*v)[k];
+      s = ((f[q] + q * q) - (f[r] + r * r)) / (2.0 * (q - r));
+      if (s > (*z)[k] || k == 0)
+        break;
+      --k;
+    }
+    ++k;
+    (*v)[k] = q;
+    (*z)[k] = s;
+    (*z)[k+1] = EDT_INF;
+  }
+
+  k = 0;
+  for (int q = 0; q < n; ++q) {
+    while ((*z)[k+1] < q)
+      ++k;
+    int r = (*v)[k];
+    (*d)[q] = (q - r) * (q - r) + f[r];
+  }
+}
+
+template<typename T_in, typename T_out=float>
+cv::Mat_<T_out> grassfire_euclidean(cv::Mat I) {
+  cv::Size size = I.size();
+  int n = std::max(size.width, size.height);
+  std::vector<double> f(n), d(n), z(n + 1);
+  std::vector<int> v(n);
+
+  cv::Mat_<double> sq(size);
+  f.resize(size.height);
+  d.resize(size.height);
+  for (int j = 0; j < size.width; ++j) {
+    for (int i = 0; i < size.height; ++i)
+      f[i] = (I.at<T_in>(i, j) > 0) ? EDT_INF : 0;
+    edt_1d(f, &d, &v, &z);
+    for (int i = 0; i < size.height; ++i)
+      sq(i, j) = d[i];
+  }
+
+  cv::Mat_<T_out> D(size);
+  f.resize(size.width);
+  d.resize(size.width);
+  for (int i = 0; i < size.height; ++i) {
+    for (int j = 0; j < size.width; ++j)
+      f[j] = sq(i, j);
+    edt_1d(f, &d, &v, &z);
+    for (int j = 0; j < size.width; ++j)
+      D(i, j) = (d[j] >= EDT_INF) ? std::numeric_limits<T_out>::max()
+                                  : sqrt(d[j]);
+  }
   return D;
 }
 
@@ -147,33 +340,49 @@ cv::Mat_<T_out> grassfire(cv::Mat I) {
 
 After the grassfire transform is applied, the skeleton $S$ is extracted by the [[skeleton]] function.
 The [[skeleton]] function extracts points using the [[neighbors_bend]] function described earlier.
+Each pixel only reads $D$, so the rows are processed in parallel with [[parallel_rows]].
 
 <<[[skeleton]] function>>=
 template<typename T_in, typename T_out=uint8_t>
 cv::Mat_<T_out> skeleton(cv::Mat D) {
   cv::Size size = D.size();
   cv::Mat_<T_out> S = cv::Mat_<T_out>::zeros(size);
-  for (int i = 0; i < size.height; ++i) {
-    for (int j = 0; j < size.width; ++j) {
-      if (neighbors_bend<T_in>(i, j, D))
-        S(i, j) = 255;
+  parallel_rows(size.height, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      for (int j = 0; j < size.width; ++j) {
+        if (neighbors_bend<T_in>(i, j, D))
+          S(i, j) = 255;
+      }
     }
-  }
+  });
   return S;
 }
 
 @ \subsection*{Implementation of [[main]]}
 
 Finally, the [[grassfire]] and [[skeleton]] functions are applied in the [[main]] function.
+Called as [[Q1 batch <pattern> <out_dir> [threads]]], it instead writes the skeleton of every matching image with [[run_batch]].
 
 <<Q1.cpp>>=
 <<Include>>
-<<Global constants>>
+<<[[png_write]] Function>>
+<<[[im_load]] Function>>
+<<[[parallel_rows]] Function>>
+<<[[PackedMask]] Function>>
 <<Convenience Functions>>
 <<[[grassfire]] function>>
 <<[[skeleton]] function>>
+<<[[run_batch]] Function>>
 
 int main(int argc, char* argv[]) {
+  <<Thread count>>
+  if (argc >= 4 && std::string("batch") == argv[1]) {
+    int threads = (argc >= 5) ? std::atoi(argv[4]) : 0;
+    return run_batch(argv[2], argv[3], threads, [](const cv::Mat_<uint8_t>& I) -> cv::Mat {
+      return skeleton<uint16_t>(grassfire(pack_mask(I)));
+    });
+  }
+
   <<Command line args>>
 
   std::string im_path = path + "/images/for_skeleton.png";
@@ -183,17 +392,21 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  cv::Mat D = grassfire<uint8_t>(I);
+  cv::Mat D = grassfire(pack_mask(cv::Mat_<uint8_t>(I)));
 
   cv::Mat S = skeleton<uint16_t>(D);
 
+  cv::Mat_<float> D_euclidean = grassfire_euclidean<uint8_t>(I);
+  cv::Mat S_euclidean = skeleton<float>(D_euclidean);
+
   uint16_t max_val = std::numeric_limits<uint16_t>::max();
   double max_dist_fp;
   cv::minMaxIdx(D, nullptr, &max_dist_fp);
   uint16_t max_dist = max_dist_fp;
   cv::Mat display_D = D * max_val / max_dist;
-  cv::imwrite(path + "/output/grassfire.png", display_D, PNG_COMPRESSION);
-  cv::imwrite(path + "/output/skeleton.png", S, PNG_COMPRESSION);
+  png_write(path + "/output/grassfire.png", display_D);
+  png_write(path + "/output/skeleton.png", S);
+  png_write(path + "/output/skeleton_euclidean.png", S_euclidean);
 
   if (display) {
     cv::imshow("Grassfire Distances", display_D);
@@ -221,3 +434,4 @@ The results of this grassfire transform and skeleton detection can be seen in Fi
 As seen in Figure~\ref{fig:skeleton}, the [[grassfire]] transform produces good results, but the [[skeleton]] function is not resistant to noise.
 It is capable of detecting horizontal and vertical lines in skeleton without much issue, and successfully detects other skeleton lines, but diagonals produce false skeleton components because of the discretization of the image.
 This could possibly be improved by using a different [[neighbors_bend]] implementation, but the current implementation is not very robust to noise.
+Running [[skeleton]] on the Euclidean distances of [[grassfire_euclidean]] instead, written to [[skeleton_euclidean.png]], removes much of the jaggedness along diagonals since distances no longer grow equally fast along diagonals and axes.
@@ -7,6 +7,7 @@ The specific use of image addition and subtraction in this implementation is to
 
 To produce this result, we start by defining functions for the arithmetic operations, beginning with [[op]] and [[scalar_op]] which apply arbitrary functions on image matrices.
 These will be used to more easily produce the desired operations.
+Both apply [[operation]] to the rows in parallel with [[parallel_rows]], so [[operation]] must not depend on the order in which pixels are visited.
 
 <<Convenience Functions>>=
 template<typename T, typename OP>
@@ -14,11 +15,13 @@ cv::Mat_<T> op(cv::Mat_<T> m1, cv::Mat_<T> m2, OP operation) {
   cv::Size size(std::min(m1.size().width, m2.size().width),
                 std::min(m1.size().height, m2.size().height));
   cv::Mat_<T> out(size);
-  for (int i = 0; i < size.height; ++i) {
-    for (int j = 0; j < size.width; ++j) {
-      out(i, j) = operation(m1(i,j), m2(i,j));
+  parallel_rows(size.height, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      for (int j = 0; j < size.width; ++j) {
+        out(i, j) = operation(m1(i,j), m2(i,j));
+      }
     }
-  }
+  });
   return out;
 }
 
@@ -26,11 +29,13 @@ template<typename T, typename S, typename OP>
 cv::Mat_<T> scalar_op(cv::Mat_<T> m, S s, OP operation) {
   cv::Size size = m.size();
   cv::Mat_<T> out(size);
-  for (int i = 0; i < size.height; ++i) {
-    for (int j = 0; j < size.width; ++j) {
-      out(i, j) = operation(m(i,j), s);
+  parallel_rows(size.height, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      for (int j = 0; j < size.width; ++j) {
+        out(i, j) = operation(m(i,j), s);
+      }
     }
-  }
+  });
   return out;
 }
 
@@ -89,14 +94,16 @@ Because the windmap image is slightly smaller than the political map, the [[zero
 
 <<Q2.cpp>>=
 <<Include>>
-<<Global constants>>
+<<[[png_write]] Function>>
 <<[[im_load]] Function>>
+<<[[parallel_rows]] Function>>
 
 <<Convenience Functions>>
 <<Arithmetic Ops>>
 <<[[zero_pad]] Function>>
 
 int main(int argc, char* argv[]) {
+  <<Thread count>>
   <<Command line args>>
 
   cv::Mat_<cv::Vec3w> america, windmap, result;
@@ -117,7 +124,7 @@ int main(int argc, char* argv[]) {
   cv::Mat_<cv::Vec3b> result_8;
   result.convertTo(result_8, cv::traits::Type<cv::Vec3b>::value);
 
-  imwrite(path + "/output/final_windmap.png", result_8, PNG_COMPRESSION);
+  png_write(path + "/output/final_windmap.png", result_8);
 
   if (display) {
     cv::imshow("America Windmap", result_8);
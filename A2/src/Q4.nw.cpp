@@ -45,15 +45,78 @@ cv::Mat pad<PadType::ZEROS>(const cv::Mat& mat, cv::Size size) {
   return padded;
 }
 
+@ \subsection*{Correlation Engines}
+
+The sum of products in Equation~\ref{eqn:correlation} can be computed by one of two engines.
+The direct engine [[correlate_direct]] loops over every template pixel for each output pixel, costing $MN$ multiply-adds per pixel, and computes its rows in parallel with [[parallel_rows]].
+
+<<Correlation Engines>>=
+template<typename T_in>
+cv::Mat_<double> correlate_direct(const cv::Mat& mat_padded, const cv::Mat& templ,
+                                  const cv::Size& out_size) {
+  cv::Mat_<double> sums(out_size);
+  parallel_rows(sums.size().height, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      for (int j = 0; j < sums.size().width; ++j) {
+        double sum = 0;
+        for (int di = 0; di < templ.rows; ++di) {
+          for (int dj = 0; dj < templ.cols; ++dj) {
+            sum += mat_padded.at<T_in>(i + di, j + dj) * templ.at<T_in>(di, dj);
+          }
+        }
+        sums(i, j) = sum;
+      }
+    }
+  });
+  return sums;
+}
+
+@ For large templates, the frequency domain engine [[correlate_fft]] uses the correlation theorem, $T \circ I = \mathcal{F}^{-1}\left(\overline{\mathcal{F}(T)} \cdot \mathcal{F}(I)\right)$, where $\mathcal{F}$ is computed by [[cv::dft]].
+The padded image and the template are zero-filled to the optimal transform size for the padded image, so the circular correlation never wraps around for the output pixels we keep and the result matches [[PadType::ZEROS]] behavior.
+The engine is chosen with [[fft_cheaper]], and its accuracy is bounded by [[FFT_TOLERANCE]], as described in the shared frequency domain section.
+
+<<Correlation Engines>>=
+<<[[fft_cheaper]] Function>>
+
+template<typename T_in>
+cv::Mat_<double> correlate_fft(const cv::Mat& mat_padded, const cv::Mat& templ,
+                               const cv::Size& out_size) {
+  cv::Size dft_size(cv::getOptimalDFTSize(mat_padded.cols),
+                    cv::getOptimalDFTSize(mat_padded.rows));
+  cv::Mat image_dft = cv::Mat::zeros(dft_size, CV_64F),
+          templ_dft = cv::Mat::zeros(dft_size, CV_64F);
+  mat_padded.convertTo(image_dft(cv::Rect(cv::Point(0, 0), mat_padded.size())), CV_64F);
+  templ.convertTo(templ_dft(cv::Rect(cv::Point(0, 0), templ.size())), CV_64F);
+
+  cv::dft(image_dft, image_dft, 0, mat_padded.rows);
+  cv::dft(templ_dft, templ_dft, 0, templ.rows);
+  cv::Mat product;
+  cv::mulSpectrums(image_dft, templ_dft, product, 0, true);
+  cv::dft(product, product, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+  return cv::Mat_<double>(product(cv::Rect(cv::Point(0, 0), out_size))).clone();
+}
+
 @ \subsection*{Correlation Operator}
 
 Next we implement the [[correlate]] function which allows both traditional and normalized correlation.
-The implementation creates a padded image then loops over all pixel locations which are central enough for the full correlation template to be applied.
+The implementation creates a padded image and computes the sums of products for all pixel locations which are central enough for the full correlation template to be applied.
+The [[CorrEngine]] enumeration selects the engine for these sums, where [[AUTO]] chooses according to [[fft_cheaper]].
+If [[CHECK_FFT]] is set, sums from the frequency domain engine are checked against [[correlate_direct]] with [[check_fft]].
 The pixel-wise operator follows Equation~\ref{eqn:correlation} for traditional correlation and Equation~\ref{eqn:norm_correlation} for normalized correlation.
 
 <<[[correlate]] Function>>=
+<<Correlation Engines>>
+
+enum CorrEngine {
+  AUTO = 0,
+  DIRECT = 1,
+  FFT = 2
+};
+
 template<typename T_in, typename T_out, PadType pad_type=PadType::NONE>
-cv::Mat_<T_out> correlate(const cv::Mat& mat, const cv::Mat& templ, bool normed=false) {
+cv::Mat_<T_out> correlate(const cv::Mat& mat, const cv::Mat& templ, bool normed=false,
+                          CorrEngine engine=CorrEngine::AUTO) {
   cv::Size templ_size = templ.size();
   cv::Mat mat_padded = pad<pad_type>(mat, templ_size);
 
@@ -63,32 +126,184 @@ cv::Mat_<T_out> correlate(const cv::Mat& mat, const cv::Mat& templ, bool normed=
   int shrink_h = (size_h - 1) / 2,
       shrink_w = (size_w - 1) / 2;
 
-  cv::Mat_<T_out> correlated(mat_padded.size().height - 2 * shrink_h,
-                             mat_padded.size().width - 2 * shrink_w);
-  for (int i = 0; i < correlated.size().height; ++i) {
-    for (int j = 0; j < correlated.size().width; ++j) {
-      double sum = 0, im_sq_sum = 0, templ_sq_sum = 0;
-      for (int di = 0; di < size_h; ++di) {
-        for (int dj = 0; dj < size_w; ++dj) {
-          T_in val = mat_padded.at<T_in>(i + di, j + dj);
-          T_in tval = templ.at<T_in>(di, dj);
-          sum += val * tval;
-          if (normed) {
-            im_sq_sum += val * val;
-            templ_sq_sum += tval * tval;
-          }
-        }
+  cv::Size out_size(mat_padded.size().width - 2 * shrink_w,
+                    mat_padded.size().height - 2 * shrink_h);
+  cv::Mat templ_used = templ(cv::Rect(0, 0, size_w, size_h));
+
+  if (engine == CorrEngine::AUTO)
+    engine = fft_cheaper(mat_padded.size(), templ_used.size()) ? CorrEngine::FFT
+                                                               : CorrEngine::DIRECT;
+  cv::Mat_<double> sums = (engine == CorrEngine::FFT)
+      ? correlate_fft<T_in>(mat_padded, templ_used, out_size)
+      : correlate_direct<T_in>(mat_padded, templ_used, out_size);
+  if (CHECK_FFT && engine == CorrEngine::FFT)
+    check_fft(sums, correlate_direct<T_in>(mat_padded, templ_used, out_size), mat_padded, templ_used);
+
+  cv::Mat_<T_out> correlated(out_size);
+  if (normed) {
+    <<Normalize correlation sums>>
+  } else {
+    for (int i = 0; i < correlated.size().height; ++i) {
+      for (int j = 0; j < correlated.size().width; ++j) {
+        correlated(i, j) = sums(i, j);
       }
-      if (normed)
-        correlated(i,j) = sum / sqrt(im_sq_sum * templ_sq_sum);
-      else
-        correlated(i, j) = sum;
     }
   }
   correlated /= (size_h * size_w);
   return correlated;
 }
 
+@ The denominator of Equation~\ref{eqn:norm_correlation} does not require another pass over the template for each pixel.
+The template energy $\sum T(m, n)^2$ is the same for every output pixel, so it is computed once.
+The image energy under each window is read from the squared summed-area table $Q$ of the padded image computed by [[cv::integral]],
+\[ \sum_{m=0}^{M} \sum_{n=0}^{N} I(y+m, x+n)^2 = Q(y+M, x+N) - Q(y, x+N) - Q(y+M, x) + Q(y, x), \]
+so the per-pixel cost of normalized correlation is dominated by the sums of products computed by the selected engine.
+The tables are accumulated in double precision, which holds integer energies exactly, so for integer images the result is identical to summing the window directly.
+Windows with zero energy produce NaN, as in Equation~\ref{eqn:norm_correlation}.
+
+<<Normalize correlation sums>>=
+double templ_sq_sum = 0;
+for (int di = 0; di < size_h; ++di) {
+  for (int dj = 0; dj < size_w; ++dj) {
+    T_in tval = templ.at<T_in>(di, dj);
+    templ_sq_sum += tval * tval;
+  }
+}
+
+cv::Mat_<double> S, Q;
+cv::integral(mat_padded, S, Q, CV_64F, CV_64F);
+for (int i = 0; i < correlated.size().height; ++i) {
+  for (int j = 0; j < correlated.size().width; ++j) {
+    double im_sq_sum = Q(i + size_h, j + size_w) - Q(i, j + size_w)
+                       - Q(i + size_h, j) + Q(i, j);
+    correlated(i, j) = sums(i, j) / sqrt(im_sq_sum * templ_sq_sum);
+  }
+}
+
+@ \subsection*{Pyramid Template Search}
+
+When only the location of the best match is needed, the dense correlation map is wasted work.
+The [[pyramid_match]] function builds Gaussian pyramids of the image and template with [[cv::pyrDown]], runs [[correlate]] densely only at the coarsest level, and refines the [[top_k]] strongest coarse candidates at full resolution.
+Each halving of the image and template divides the dense cost by 16, so the cost is dominated by the refinement windows.
+Levels are added until [[levels]] is reached or the template would shrink below [[MIN_PYRAMID_TEMPL]] pixels on a side.
+
+The [[correlate_at]] function evaluates a single output pixel of [[correlate]] at full resolution, using the same summation order as [[correlate_direct]] and the same rounding to [[T_out]].
+
+<<Pyramid Search>>=
+const int MIN_PYRAMID_TEMPL = 8;
+const bool CHECK_PYRAMID = std::getenv("CSCE590_CHECK_PYRAMID") != nullptr;
+
+struct TemplateMatch {
+  cv::Point loc;
+  double score;
+  bool differs_from_exhaustive;
+};
+
+template<typename T_in, typename T_out>
+T_out correlate_at(const cv::Mat& mat_padded, const cv::Mat& templ, int i, int j,
+                   bool normed, double templ_sq_sum) {
+  double sum = 0, im_sq_sum = 0;
+  for (int di = 0; di < templ.rows; ++di) {
+    for (int dj = 0; dj < templ.cols; ++dj) {
+      T_in val = mat_padded.at<T_in>(i + di, j + dj);
+      sum += val * templ.at<T_in>(di, dj);
+      im_sq_sum += val * val;
+    }
+  }
+  T_out result = normed ? sum / sqrt(im_sq_sum * templ_sq_sum) : sum;
+  result /= (templ.rows * templ.cols);
+  return result;
+}
+
+@ Candidates at the coarsest level are taken greedily from the correlation map, suppressing a region the size of the coarse template around each one so the candidates cover distinct parts of the image.
+The search stops early once every position has been suppressed, so no candidate is refined twice.
+Each candidate at level $L$ maps to a $(2^{L+1}+1) \times (2^{L+1}+1)$ window of full resolution positions which is searched exhaustively with [[correlate_at]].
+Positions without a valid score (windows of zero energy in normalized correlation) are skipped.
+
+When the caller has already computed the dense [[correlate]] map at full resolution, it can pass it as [[dense]], and [[differs_from_exhaustive]] records whether its maximum is at a different location.
+A warning is printed in that case so the pyramid search can be checked against the dense path without computing the dense map twice.
+The [[main]] function only passes its dense map when the environment variable [[CSCE590_CHECK_PYRAMID]] is set, as the comparison is a check rather than part of the search.
+
+<<Pyramid Search>>=
+template<typename T_in>
+TemplateMatch pyramid_match(const cv::Mat& image, const cv::Mat& templ, bool normed=false,
+                            int levels=3, int top_k=5, const cv::Mat* dense=nullptr) {
+  std::vector<cv::Mat> image_pyr(1, image), templ_pyr(1, templ);
+  while ((int) image_pyr.size() <= levels
+         && templ_pyr.back().rows / 2 >= MIN_PYRAMID_TEMPL
+         && templ_pyr.back().cols / 2 >= MIN_PYRAMID_TEMPL) {
+    cv::Mat image_down, templ_down;
+    cv::pyrDown(image_pyr.back(), image_down);
+    cv::pyrDown(templ_pyr.back(), templ_down);
+    image_pyr.push_back(image_down);
+    templ_pyr.push_back(templ_down);
+  }
+  const int top = image_pyr.size() - 1,
+            scale = 1 << top;
+
+  cv::Mat_<float> coarse = correlate<T_in, float, PadType::ZEROS>(
+      image_pyr[top], templ_pyr[top], normed);
+  cv::patchNaNs(coarse, -std::numeric_limits<float>::max());
+  std::vector<cv::Point> candidates;
+  for (int k = 0; k < top_k; ++k) {
+    cv::Point max_loc;
+    double max_val;
+    cv::minMaxLoc(coarse, nullptr, &max_val, nullptr, &max_loc);
+    if (max_val == -std::numeric_limits<float>::max())
+      break;
+    candidates.push_back(max_loc);
+    cv::Size suppress = templ_pyr[top].size();
+    cv::Rect region(max_loc.x - suppress.width / 2, max_loc.y - suppress.height / 2,
+                    suppress.width, suppress.height);
+    coarse(region & cv::Rect(cv::Point(0, 0), coarse.size()))
+        = -std::numeric_limits<float>::max();
+  }
+
+  int size_h = templ.rows - ((templ.rows + 1) % 2),
+      size_w = templ.cols - ((templ.cols + 1) % 2);
+  cv::Mat templ_used = templ(cv::Rect(0, 0, size_w, size_h));
+  cv::Mat mat_padded = pad<PadType::ZEROS>(image, templ.size());
+  double templ_sq_sum = 0;
+  for (int di = 0; di < size_h; ++di) {
+    for (int dj = 0; dj < size_w; ++dj) {
+      T_in tval = templ_used.at<T_in>(di, dj);
+      templ_sq_sum += tval * tval;
+    }
+  }
+
+  TemplateMatch best = {cv::Point(-1, -1), -std::numeric_limits<double>::infinity(), false};
+  for (int k = 0; k < candidates.size(); ++k) {
+    cv::Point center = candidates[k] * scale;
+    for (int i = std::max(0, center.y - scale);
+         i <= std::min(image.rows - 1, center.y + scale); ++i) {
+      for (int j = std::max(0, center.x - scale);
+           j <= std::min(image.cols - 1, center.x + scale); ++j) {
+        double score = correlate_at<T_in, float>(mat_padded, templ_used, i, j,
+                                                 normed, templ_sq_sum);
+        if (score > best.score) {
+          best.loc = cv::Point(j, i);
+          best.score = score;
+        }
+      }
+    }
+  }
+
+  if (dense) {
+    cv::Mat_<float> dense_valid = dense->clone();
+    cv::patchNaNs(dense_valid, -std::numeric_limits<float>::max());
+    cv::Point dense_loc;
+    double dense_score;
+    cv::minMaxLoc(dense_valid, nullptr, &dense_score, nullptr, &dense_loc);
+    best.differs_from_exhaustive = dense_loc != best.loc;
+    if (best.differs_from_exhaustive) {
+      std::cerr << "WARNING: pyramid match at " << best.loc << " (score " << best.score
+                << ") differs from exhaustive match at " << dense_loc
+                << " (score " << dense_score << ")" << std::endl;
+    }
+  }
+  return best;
+}
+
 @ \subsection*{Visualization}
 
 To provide a better visualization for the [[correlate]] function, we provide functions which find the location of maximum intensity in the correlation image and draw a rectangle on the original image corresponding to that location of maximum correlation.
@@ -123,16 +338,59 @@ cv::Mat in_range(const cv::Mat& image) {
 
 Finally, the [[main]] function is implemented to read several images and apply the correlation operator on them.
 The OpenCV equivalent is provided to validate each operation, but the results are not included in this report.
+Called as [[Q4 batch <pattern> <template> <out_dir> [threads]]], it annotates the best normalized match of the template in every matching image with [[run_batch]].
+Called as [[Q4 stream <input> <template> <output> [band_rows]]], it instead computes the normalized correlation of a large image using [[stream_bands]].
+Pixels of an 8 bit image are never negative, so the normalized correlation lies in $[0, 1]$, and [[correlate]] divides it by the $MN$ pixels of the template used; the bands are multiplied by $255 MN$ to map them to $[0, 255]$.
+The halo is the larger dimension of the template, since [[pad]] offsets the image vertically by half the template width, not its height.
 
 <<Q4.cpp>>=
 <<Include>>
-<<Global constants>>
+<<[[png_write]] Function>>
+<<[[im_load]] Function>>
+<<[[parallel_rows]] Function>>
+<<[[stream_bands]] Function>>
 <<[[pad]] Function>>
 <<[[correlate]] Function>>
+<<Pyramid Search>>
 <<Annotation Functions>>
 <<[[in_range]] Function>>
+<<[[run_batch]] Function>>
 
 int main(int argc, char* argv[]) {
+  <<Thread count>>
+  if (argc >= 5 && std::string("batch") == argv[1]) {
+    cv::Mat templ = cv::imread(argv[3], 0);
+    if(!templ.data) {
+      std::cout << "Failed to read template image " << argv[3] << std::endl;
+      return 1;
+    }
+    int threads = (argc >= 6) ? std::atoi(argv[5]) : 0;
+    return run_batch(argv[2], argv[4], threads, [&](const cv::Mat_<uint8_t>& image) -> cv::Mat {
+      cv::Mat correlation = correlate<uint8_t, float, PadType::ZEROS>(image, templ, true);
+      return annotate_correlation(image, correlation, templ.size());
+    });
+  }
+
+  if (argc >= 5 && std::string("stream") == argv[1]) {
+    cv::Mat templ = cv::imread(argv[3], 0);
+    if(!templ.data) {
+      std::cout << "Failed to read template image " << argv[3] << std::endl;
+      return 1;
+    }
+    int band_rows = (argc >= 6) ? std::atoi(argv[5]) : STREAM_BAND_ROWS;
+    // Size of the template used by correlate, which drops a row and column to make it odd
+    const double templ_area = (templ.rows - (templ.rows + 1) % 2)
+                              * (templ.cols - (templ.cols + 1) % 2);
+    bool success = stream_bands(argv[2], argv[4], cv::IMREAD_GRAYSCALE, band_rows,
+                                std::max(templ.rows, templ.cols), [&](const cv::Mat& band) -> cv::Mat {
+          cv::Mat normed;
+          correlate<uint8_t, float, PadType::ZEROS>(band, templ, true)
+              .convertTo(normed, CV_8U, 255.0 * templ_area);
+          return normed;
+        });
+    return success ? 0 : 1;
+  }
+
   <<Command line args>>
 
   std::string im_path = path + "/images/for_correlation_small.jpg",
@@ -154,6 +412,11 @@ int main(int argc, char* argv[]) {
   cv::Mat correlation_normed
       = correlate<uint8_t, float, PadType::ZEROS>(image, templ, true);
 
+  TemplateMatch match = pyramid_match<uint8_t>(image, templ, true, 3, 5,
+                                               CHECK_PYRAMID ? &correlation_normed : nullptr);
+  std::cout << "Pyramid match at " << match.loc << " with normalized score "
+            << match.score << std::endl;
+
   cv::Mat correlation_display
       = in_range<uint8_t>(correlation);
   cv::Mat correlation_annotated
@@ -164,15 +427,15 @@ int main(int argc, char* argv[]) {
   cv::Mat correlation_normed_annotated
       = annotate_correlation(image, correlation_normed, templ.size());
 
-  cv::imwrite(path + "/output/correlation.png",
-              correlation_display, PNG_COMPRESSION);
-  cv::imwrite(path + "/output/correlation_annotated.png",
-              correlation_annotated, PNG_COMPRESSION);
+  png_write(path + "/output/correlation.png",
+            correlation_display);
+  png_write(path + "/output/correlation_annotated.png",
+            correlation_annotated);
 
-  cv::imwrite(path + "/output/correlation_normed.png",
-              correlation_normed_display, PNG_COMPRESSION);
-  cv::imwrite(path + "/output/correlation_normed_annotated.png",
-              correlation_normed_annotated, PNG_COMPRESSION);
+  png_write(path + "/output/correlation_normed.png",
+            correlation_normed_display);
+  png_write(path + "/output/correlation_normed_annotated.png",
+            correlation_normed_annotated);
 
   /* Comparable OpenCV operations provided for validation */
   cv::Mat cv_correlation, cv_correlation_normed;
@@ -191,15 +454,15 @@ int main(int argc, char* argv[]) {
   cv::Mat cv_correlation_normed_annotated
       = annotate_correlation(image, cv_correlation_normed, templ.size());
 
-  cv::imwrite(path + "/output/cv_correlation.png",
-              cv_correlation_display, PNG_COMPRESSION);
-  cv::imwrite(path + "/output/cv_correlation_annotated.png",
-              cv_correlation_annotated, PNG_COMPRESSION);
+  png_write(path + "/output/cv_correlation.png",
+            cv_correlation_display);
+  png_write(path + "/output/cv_correlation_annotated.png",
+            cv_correlation_annotated);
 
-  cv::imwrite(path + "/output/cv_correlation_normed.png",
-              cv_correlation_normed_display, PNG_COMPRESSION);
-  cv::imwrite(path + "/output/cv_correlation_normed_annotated.png",
-              cv_correlation_normed_annotated, PNG_COMPRESSION);
+  png_write(path + "/output/cv_correlation_normed.png",
+            cv_correlation_normed_display);
+  png_write(path + "/output/cv_correlation_normed_annotated.png",
+            cv_correlation_normed_annotated);
 
   if (display) {
     cv::imshow("Correlation", correlation_display);
@@ -6,15 +6,26 @@ This section provides several insignificant code snippets which are used by the
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 
 #include <iostream>
 #include <cmath>
 #include <set>
 #include <limits>
+#include <functional>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <cctype>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <fstream>
-
-<<Global constants>>=
-const std::vector<int> PNG_COMPRESSION = {CV_IMWRITE_PNG_COMPRESSION, 9};
+#include <algorithm>
 
 <<Command line args>>=
 std::string path;
@@ -32,9 +43,26 @@ if (argc == 2 || (argc == 3 && std::string("display") == argv[2])) {
 }
 path = argv[1];
 
+@ Every [[main]] first applies the thread count set in the environment variable [[CSCE590_THREADS]], before choosing between its modes, so it also limits the batch and stream modes.
+
+<<Thread count>>=
+if (std::getenv("CSCE590_THREADS"))
+  cv::setNumThreads(std::atoi(std::getenv("CSCE590_THREADS")));
+
+@ The [[im_load]] function reads an image through a [[MappedImage]] when the format allows and through [[cv::imread]] otherwise.
+The image is copied out of the mapping since the caller owns the result.
+
 <<[[im_load]] Function>>=
+<<[[MappedImage]] Function>>
+
 template<typename T>
 bool im_load(const std::string& im_path, cv::Mat_<T>* mat, int mode=cv::IMREAD_COLOR) {
+  MappedImage mapped;
+  if (mapped.open(im_path)) {
+    mapped.to_mode(mode).assignTo(*mat, cv::traits::Type<T>::value);
+    return true;
+  }
+
   cv::Mat tmp = cv::imread(im_path, mode);
   if(!tmp.data) {
     std::cout << "Failed to read image " << im_path << std::endl;
@@ -139,8 +139,300 @@ It calculates the dot product of the neighborhood around each pixel and the kern
 
 <<[[conv]] Function>>=
 <<[[pad]] Function>>
+<<Convolution Engines>>
+
+@ Every engine must store its sums into the output type the same way, so the clamping step is factored out into [[conv_store]].
+Sums below the minimum of the kernel type are clamped to that minimum, sums above its maximum are clamped to the maximum, and everything else is cast directly.
+
+<<Convolution Engines>>=
+template <typename T, typename K>
+T conv_store(const double sum) {
+  K k_min = std::numeric_limits<K>::min(),
+    k_max = std::numeric_limits<K>::max();
+  if (sum < k_min)
+    return k_min;
+  else if (sum > k_max)
+    return k_max;
+  else
+    return sum;
+}
+
+@ The direct engine [[conv_direct]] follows Equation~\ref{eqn:convolution} literally, costing $MN$ multiply-adds for each output pixel.
+The sum for a single pixel is computed by [[conv_direct_sum]], which the other engines also use to recompute a pixel exactly.
+If [[sums]] is not null, the sums before [[conv_store]] are also returned through it.
+
+<<Convolution Engines>>=
+template <typename T, typename K>
+double conv_direct_sum(const cv::Mat_<T>& mat_padded, const cv::Mat_<K>& kernel,
+                       const int y, const int x) {
+  int M = kernel.rows,
+      N = kernel.cols;
+
+  double sum = 0;
+  for (int dy = 0; dy < M; ++dy) {
+    for (int dx = 0; dx < N; ++dx) {
+      sum += kernel(dy, dx) * mat_padded(y - dy + (M-1), x - dx + (N-1));
+    }
+  }
+  return sum;
+}
+
+template <typename T, typename K>
+cv::Mat_<T> conv_direct(const cv::Mat_<T>& mat_padded, const cv::Mat_<K>& kernel,
+                        const cv::Size& out_size, cv::Mat_<double>* sums=nullptr) {
+  cv::Mat_<T> convolved(out_size);
+  if (sums)
+    sums->create(out_size);
+  parallel_rows(convolved.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      for (int x = 0; x < convolved.cols; ++x) {
+        double sum = conv_direct_sum(mat_padded, kernel, y, x);
+        convolved(y, x) = conv_store<T, K>(sum);
+        if (sums)
+          (*sums)(y, x) = sum;
+      }
+    }
+  });
+  return convolved;
+}
+
+@ The faster engines below compute the same sums in a different order, so their sums differ from those of [[conv_direct]] by rounding.
+For integer outputs this only matters where an integer lies between the two sums, since [[conv_store]] truncates everything else to the same value.
+Each engine knows a bound $b$ on the difference, given by [[conv_fast_bound]] as the engine's own [[tolerance]] plus the rounding of both orders of summation, relative to the largest possible sum $S = \max\left|I\right| \sum \left|T\right|$.
+[[conv_fast_store]] keeps a fast sum $f$ when $\lfloor f - b \rfloor = \lfloor f + b \rfloor$, where both sums truncate to the same value, and otherwise recomputes the pixel with [[conv_direct_sum]].
+The output of every engine is therefore identical to that of [[conv_direct]], while only the few pixels whose sums lie within $b$ of an integer, around $10^{-10}$ for 8-bit images, pay for the direct sum.
+Floating point outputs show every rounding, so for them the fast engines agree with [[conv_direct]] only up to $b$.
+
+<<Convolution Engines>>=
+template <typename T, typename K>
+double conv_fast_bound(const cv::Mat_<T>& mat_padded, const cv::Mat_<K>& kernel,
+                       const double tolerance) {
+  int M = kernel.rows,
+      N = kernel.cols;
+  double rounding = 2.0 * (M * N + M + N) * std::numeric_limits<double>::epsilon();
+  return (tolerance + rounding) * cv::norm(mat_padded, cv::NORM_INF)
+                                * cv::norm(kernel, cv::NORM_L1);
+}
+
+template <typename T, typename K>
+T conv_fast_store(double sum, const double bound, const cv::Mat_<T>& mat_padded,
+                  const cv::Mat_<K>& kernel, const int y, const int x) {
+  if (std::numeric_limits<T>::is_integer && std::floor(sum - bound) != std::floor(sum + bound))
+    sum = conv_direct_sum(mat_padded, kernel, y, x);
+  return conv_store<T, K>(sum);
+}
+
+@ \subsection*{Separable Kernels}
+
+Many useful kernels, including the average, Gaussian, and edge kernels above, are separable.
+That is, they can be written as the outer product $K = c \cdot r^T$ of a column vector $c$ and a row vector $r$.
+The [[separable]] function tests for this by taking the entry of largest magnitude $K(p, q)$ as a pivot and setting $c = K(\cdot, q)$ and $r = K(p, \cdot) / K(p, q)$.
+The kernel is rank one exactly when every entry matches $c_m r_n$, which we check against a tolerance relative to the pivot.
+
+<<Convolution Engines>>=
+const double SEPARABLE_TOLERANCE = 1e-12;
+
+template <typename K>
+bool separable(const cv::Mat_<K>& kernel, cv::Mat_<double>* col,
+               cv::Mat_<double>* row, const double tolerance=SEPARABLE_TOLERANCE) {
+  int pivot_y = 0, pivot_x = 0;
+  double max_abs = 0;
+  for (int y = 0; y < kernel.rows; ++y) {
+    for (int x = 0; x < kernel.cols; ++x) {
+      if (std::abs((double) kernel(y, x)) > max_abs) {
+        max_abs = std::abs((double) kernel(y, x));
+        pivot_y = y;
+        pivot_x = x;
+      }
+    }
+  }
+  if (max_abs == 0)
+    return false;
+
+  double pivot = kernel(pivot_y, pivot_x);
+  col->create(kernel.rows, 1);
+  row->create(1, kernel.cols);
+  for (int y = 0; y < kernel.rows; ++y)
+    (*col)(y, 0) = kernel(y, pivot_x);
+  for (int x = 0; x < kernel.cols; ++x)
+    (*row)(0, x) = kernel(pivot_y, x) / pivot;
+
+  for (int y = 0; y < kernel.rows; ++y) {
+    for (int x = 0; x < kernel.cols; ++x) {
+      if (std::abs(kernel(y, x) - (*col)(y, 0) * (*row)(0, x)) > tolerance * max_abs)
+        return false;
+    }
+  }
+  return true;
+}
+
+@ For a separable kernel, Equation~\ref{eqn:convolution} splits into a horizontal pass with $r$ followed by a vertical pass with $c$:
+\[ H(y, x) = \sum_{n=0}^{N} r_n \cdot I(y, x-n), \qquad T(y, x) \ast I(y, x) = \sum_{m=0}^{M} c_m \cdot H(y-m, x). \]
+The horizontal pass runs over every row of the padded image so the vertical pass has the rows it needs above and below each output pixel.
+This reduces the cost per pixel from $MN$ to $M+N$ multiply-adds.
+The intermediate image $H$ is kept in double precision, and each sum is stored with [[conv_fast_store]].
+Each of the $MN$ entries of $c \cdot r^T$ may differ from the kernel by [[SEPARABLE_TOLERANCE]] times the pivot, so the engine's tolerance is $MN$ times that.
+
+<<Convolution Engines>>=
+template <typename T, typename K>
+cv::Mat_<T> conv_separable(const cv::Mat_<T>& mat_padded, const cv::Mat_<K>& kernel,
+                           const cv::Mat_<double>& col, const cv::Mat_<double>& row,
+                           const cv::Size& out_size) {
+  int M = col.rows,
+      N = row.cols;
+  const double bound = conv_fast_bound(mat_padded, kernel, M * N * SEPARABLE_TOLERANCE);
+
+  cv::Mat_<double> horizontal(mat_padded.rows, out_size.width);
+  parallel_rows(horizontal.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      for (int x = 0; x < horizontal.cols; ++x) {
+        double sum = 0;
+        for (int dx = 0; dx < N; ++dx) {
+          sum += row(0, dx) * mat_padded(y, x - dx + (N-1));
+        }
+        horizontal(y, x) = sum;
+      }
+    }
+  });
+
+  cv::Mat_<T> convolved(out_size);
+  parallel_rows(convolved.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      for (int x = 0; x < convolved.cols; ++x) {
+        double sum = 0;
+        for (int dy = 0; dy < M; ++dy) {
+          sum += col(dy, 0) * horizontal(y - dy + (M-1), x);
+        }
+        convolved(y, x) = conv_fast_store(sum, bound, mat_padded, kernel, y, x);
+      }
+    }
+  });
+  return convolved;
+}
+
+@ \subsection*{Box Filtering}
+
+The average kernel is not only separable but uniform, so convolving with it only requires the sum of the image over an $M \times N$ window.
+The [[uniform]] function checks that every entry of the kernel matches the first, non-zero entry.
+
+<<Convolution Engines>>=
+template <typename K>
+bool uniform(const cv::Mat_<K>& kernel) {
+  const K value = kernel(0, 0);
+  if (value == 0)
+    return false;
+  for (int y = 0; y < kernel.rows; ++y) {
+    for (int x = 0; x < kernel.cols; ++x) {
+      if (kernel(y, x) != value)
+        return false;
+    }
+  }
+  return true;
+}
+
+@ The [[conv_box]] engine builds the summed-area table $S$ of the padded image with [[cv::integral]], where $S(y, x)$ is the sum of all pixels above and to the left of $(y, x)$.
+The sum over any window then takes four lookups,
+\[ \sum_{m=0}^{M} \sum_{n=0}^{N} I(y+m, x+n) = S(y+M, x+N) - S(y, x+N) - S(y+M, x) + S(y, x), \]
+so the cost per pixel does not depend on the kernel size.
+The table is accumulated in double precision, which holds integer pixel sums exactly, so the window sum is only rounded once when it is multiplied by the kernel value.
+The result is stored with [[conv_fast_store]] with no tolerance of its own, which recomputes the pixels where [[conv_direct]] could truncate the $MN$ rounded products differently, such as flat regions whose exact average is an integer.
+
+<<Convolution Engines>>=
+template <typename T, typename K>
+cv::Mat_<T> conv_box(const cv::Mat_<T>& mat_padded, const cv::Mat_<K>& kernel,
+                     const cv::Size& out_size) {
+  int M = kernel.rows,
+      N = kernel.cols;
+  const double value = kernel(0, 0);
+  const double bound = conv_fast_bound(mat_padded, kernel, 0);
+
+  cv::Mat_<double> S;
+  cv::integral(mat_padded, S, CV_64F);
+
+  cv::Mat_<T> convolved(out_size);
+  parallel_rows(convolved.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      for (int x = 0; x < convolved.cols; ++x) {
+        double sum = S(y + M, x + N) - S(y, x + N) - S(y + M, x) + S(y, x);
+        convolved(y, x) = conv_fast_store(value * sum, bound, mat_padded, kernel, y, x);
+      }
+    }
+  });
+  return convolved;
+}
+
+@ \subsection*{Frequency Domain Convolution}
+
+Kernels which are neither uniform nor separable still cost $MN$ multiply-adds per pixel in [[conv_direct]].
+For large kernels it is cheaper to use the convolution theorem, $T \ast I = \mathcal{F}^{-1}\left(\mathcal{F}(T) \cdot \mathcal{F}(I)\right)$, where $\mathcal{F}$ is computed by [[cv::dft]].
+The padded image and the kernel are both zero-filled to the optimal transform size for the padded image, so the circular convolution computed by the transform never wraps around for the output pixels we keep.
+Because the image is already padded by [[pad]], the result matches [[PadType::ZEROS]] behavior exactly in exact arithmetic.
+The engine is chosen with [[fft_cheaper]], and its accuracy before [[conv_store]] is bounded by [[FFT_TOLERANCE]], as described in the shared frequency domain section.
+Since that bounds the difference from the sums of [[conv_direct]], it is the engine's tolerance for [[conv_fast_store]].
+If [[CHECK_FFT]] is set, the sums are checked against the sums of [[conv_direct]] with [[check_fft]].
+
+<<Convolution Engines>>=
+<<[[fft_cheaper]] Function>>
+
+template <typename T, typename K>
+cv::Mat_<T> conv_fft(const cv::Mat_<T>& mat_padded, const cv::Mat_<K>& kernel,
+                     const cv::Size& out_size) {
+  int M = kernel.rows,
+      N = kernel.cols;
+
+  cv::Size dft_size(cv::getOptimalDFTSize(mat_padded.cols),
+                    cv::getOptimalDFTSize(mat_padded.rows));
+  cv::Mat image_dft = cv::Mat::zeros(dft_size, CV_64F),
+          kernel_dft = cv::Mat::zeros(dft_size, CV_64F);
+  mat_padded.convertTo(image_dft(cv::Rect(cv::Point(0, 0), mat_padded.size())), CV_64F);
+  kernel.convertTo(kernel_dft(cv::Rect(cv::Point(0, 0), kernel.size())), CV_64F);
+
+  cv::dft(image_dft, image_dft, 0, mat_padded.rows);
+  cv::dft(kernel_dft, kernel_dft, 0, M);
+  cv::Mat product;
+  cv::mulSpectrums(image_dft, kernel_dft, product, 0);
+  cv::dft(product, product, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+  cv::Mat_<double> full = product;
+  if (CHECK_FFT) {
+    cv::Mat_<double> direct;
+    conv_direct(mat_padded, kernel, out_size, &direct);
+    check_fft(full(cv::Rect(cv::Point(N-1, M-1), out_size)), direct, mat_padded, kernel);
+  }
+
+  const double bound = conv_fast_bound(mat_padded, kernel, FFT_TOLERANCE);
+  cv::Mat_<T> convolved(out_size);
+  parallel_rows(convolved.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      for (int x = 0; x < convolved.cols; ++x) {
+        convolved(y, x) = conv_fast_store(full(y + (M-1), x + (N-1)), bound,
+                                          mat_padded, kernel, y, x);
+      }
+    }
+  });
+  return convolved;
+}
+
+@ \subsection*{Engine Selection}
+
+The [[conv]] function pads the image and hands it to one of the engines above.
+Each engine computes its output rows in parallel with [[parallel_rows]]; the separable engine does so once per pass.
+The [[ConvEngine]] enumeration selects the engine explicitly, and [[AUTO]] picks the cheapest engine which is valid for the kernel: [[BOX]] for uniform kernels, [[SEPARABLE]] for rank one kernels, then [[FFT]] or [[DIRECT]] according to [[fft_cheaper]].
+Since the fast engines are only identical to [[conv_direct]] for integer outputs, [[AUTO]] always picks [[DIRECT]] for floating point outputs, where the other engines must be requested explicitly.
+Requesting an engine which cannot handle the kernel is reported as an error.
+
+<<[[conv]] Function>>=
+enum ConvEngine {
+  AUTO = 0,
+  DIRECT = 1,
+  SEPARABLE = 2,
+  BOX = 3,
+  FFT = 4
+};
+
 template <typename T, typename K, PadType pad_type=PadType::ZEROS>
-cv::Mat_<T> conv(const cv::Mat_<T> mat, const cv::Mat_<K> kernel) {
+cv::Mat_<T> conv(const cv::Mat_<T> mat, const cv::Mat_<K> kernel,
+                 ConvEngine engine=ConvEngine::AUTO) {
   if (kernel.rows % 2 == 0 || kernel.cols % 2 == 0) {
     std::cerr << "ERROR: kernel dimensions must be odd for `conv` function" << std::endl;
     return cv::Mat_<T>();
@@ -150,50 +442,106 @@ cv::Mat_<T> conv(const cv::Mat_<T> mat, const cv::Mat_<K> kernel) {
   int size_h = kernel.rows - ((kernel.rows + 1) % 2),
       size_w = kernel.cols - ((kernel.cols + 1) % 2);
 
-  int M = kernel.rows,
-      N = kernel.cols;
-
   int shrink_h = (size_h - 1) / 2,
       shrink_w = (size_w - 1) / 2;
 
-  cv::Mat_<T> convolved(mat_padded.size().height - 2 * shrink_h,
-                        mat_padded.size().width  - 2 * shrink_w);
-  for (int y = 0; y < convolved.rows; ++y) {
-    for (int x = 0; x < convolved.cols; ++x) {
-      double sum = 0;
-      for (int dy = 0; dy < kernel.rows; ++dy) {
-        for (int dx = 0; dx < kernel.cols; ++dx) {
-          sum += kernel(dy, dx) * mat_padded(y - dy + (M-1), x - dx + (N-1));
-        }
-      }
-      K k_min = std::numeric_limits<K>::min(),
-        k_max = std::numeric_limits<K>::max();
-      if (sum < k_min)
-        convolved(y, x) = k_min;
-      else if (sum > k_max)
-        convolved(y, x) = k_max;
-      else
-        convolved(y, x) = sum;
-    }
+  cv::Size out_size(mat_padded.size().width  - 2 * shrink_w,
+                    mat_padded.size().height - 2 * shrink_h);
+
+  cv::Mat_<double> col, row;
+  bool is_uniform = engine != ConvEngine::DIRECT && uniform(kernel);
+  bool is_separable = engine != ConvEngine::DIRECT
+                      && separable(kernel, &col, &row);
+  if (engine == ConvEngine::AUTO) {
+    if (!std::numeric_limits<T>::is_integer)
+      engine = ConvEngine::DIRECT;
+    else if (is_uniform)
+      engine = ConvEngine::BOX;
+    else if (is_separable)
+      engine = ConvEngine::SEPARABLE;
+    else if (fft_cheaper(mat_padded.size(), kernel.size()))
+      engine = ConvEngine::FFT;
+    else
+      engine = ConvEngine::DIRECT;
   }
 
-  return convolved;
+  switch (engine) {
+    case ConvEngine::BOX:
+      if (!is_uniform) {
+        std::cerr << "ERROR: kernel is not uniform for `conv` function" << std::endl;
+        return cv::Mat_<T>();
+      }
+      return conv_box(mat_padded, kernel, out_size);
+    case ConvEngine::SEPARABLE:
+      if (!is_separable) {
+        std::cerr << "ERROR: kernel is not separable for `conv` function" << std::endl;
+        return cv::Mat_<T>();
+      }
+      return conv_separable(mat_padded, kernel, col, row, out_size);
+    case ConvEngine::FFT:
+      return conv_fft(mat_padded, kernel, out_size);
+    default:
+      return conv_direct(mat_padded, kernel, out_size);
+  }
 }
 
 @ \subsection*{Implementation of [[main]]}
 
 The [[main]] function simply uses the [[conv]] function on two images with various kernels.
 The OpenCV alternatives are included also for comparison, but they perform correlation rather than convolution.
+Called as [[Q1 batch <pattern> <out_dir> [kernel] [threads]]], it convolves every matching image with [[run_batch]].
+Called as [[Q1 stream <input> <output> [kernel] [band_rows]]], it instead convolves a large image with one of the named kernels using [[stream_bands]], with half the kernel height as halo.
 
 <<Q1.cpp>>=
 <<Include>>
-<<Global constants>>
+<<[[png_write]] Function>>
 <<[[im_load]] Function>>
+<<[[parallel_rows]] Function>>
+<<[[stream_bands]] Function>>
 <<[[conv]] Function>>
+<<[[run_batch]] Function>>
 
 <<Kernel Definitions>>
 
 int main(int argc, char* argv[]) {
+  <<Thread count>>
+  std::vector<std::string> save_names = {"avg", "gauss", "vedge",
+                                         "hedge", "sharp", "custom"};
+  std::vector<cv::Mat_<double> > kernels = {
+      makeAverageKernel(15), makeGaussianKernel(15), makeVEdgeKernel(3),
+      makeHEdgeKernel(3), makeSharpenKernel3x3(), makeCustomKernel3x3()
+  };
+
+  if (argc >= 4 && std::string("batch") == argv[1]) {
+    std::string name = (argc >= 5) ? argv[4] : "gauss";
+    int threads = (argc >= 6) ? std::atoi(argv[5]) : 0;
+    int k = std::find(save_names.begin(), save_names.end(), name) - save_names.begin();
+    if (k == save_names.size()) {
+      std::cerr << "ERROR: unknown kernel " << name << std::endl;
+      return 1;
+    }
+    const cv::Mat_<double>& kernel = kernels[k];
+    return run_batch(argv[2], argv[3], threads, [&](const cv::Mat_<uint8_t>& image) -> cv::Mat {
+      return conv(image, kernel);
+    });
+  }
+
+  if (argc >= 4 && std::string("stream") == argv[1]) {
+    std::string name = (argc >= 5) ? argv[4] : "gauss";
+    int band_rows = (argc >= 6) ? std::atoi(argv[5]) : STREAM_BAND_ROWS;
+    int k = std::find(save_names.begin(), save_names.end(), name) - save_names.begin();
+    if (k == save_names.size()) {
+      std::cerr << "ERROR: unknown kernel " << name << std::endl;
+      return 1;
+    }
+    const cv::Mat_<double>& kernel = kernels[k];
+    bool success = stream_bands(argv[2], argv[3], cv::IMREAD_GRAYSCALE, band_rows,
+                                kernel.rows / 2, [&](const cv::Mat& band) -> cv::Mat {
+          return conv(cv::Mat_<uint8_t>(band), kernel);
+        });
+    return success ? 0 : 1;
+  }
+
   <<Command line args>>
 
   const int n_images = 2;
@@ -206,22 +554,15 @@ int main(int argc, char* argv[]) {
   if (!read_success)
     return 1;
 
-  std::vector<std::string> save_names = {"avg", "gauss", "vedge",
-                                         "hedge", "sharp", "custom"};
-  std::vector<cv::Mat_<double> > kernels = {
-      makeAverageKernel(15), makeGaussianKernel(15), makeVEdgeKernel(3),
-      makeHEdgeKernel(3), makeSharpenKernel3x3(), makeCustomKernel3x3()
-  };
-
   for (int im = 0; im < n_images; ++im) {
     for (int i = 0; i < kernels.size(); ++i) {
       cv::Mat_<uint8_t> conved = conv(images[im], kernels[i]);
       cv::Mat_<uint8_t> cv_conved;
       cv::filter2D(images[im], cv_conved, -1, kernels[i]);
-      cv::imwrite(path + "/output/conv_" + save_names[i] + "_"
-                  + std::to_string(im+1) + ".png", conved, PNG_COMPRESSION);
-      cv::imwrite(path + "/output/cv_conv_" + save_names[i] + "_"
-                  + std::to_string(im+1) + ".png", cv_conved, PNG_COMPRESSION);
+      png_write(path + "/output/conv_" + save_names[i] + "_"
+                + std::to_string(im+1) + ".png", conved);
+      png_write(path + "/output/cv_conv_" + save_names[i] + "_"
+                + std::to_string(im+1) + ".png", cv_conved);
     }
   }
 }
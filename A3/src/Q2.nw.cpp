@@ -28,53 +28,368 @@ std::pair<double, double> thresh_avg(const cv::Mat_<T> mat, T thresh) {
   return std::make_pair(above_avg, below_avg);
 }
 
+@ Since [[thresh_avg]] visits every pixel, each iteration costs a full pass over the image.
+For 8 bit images, we instead count the pixels of each value once in [[thresh_histogram]] and keep prefix sums of the counts and values, where [[count[t]]] and [[sum[t]]] are the number and sum of pixels with value below $t$.
+The means on either side of any threshold then follow from two lookups each, so every iteration takes constant time.
+The sums are exact integers, so the means, and hence the thresholds, are the same as those of [[thresh_avg]].
+For other types, [[thresh_histogram]] returns false and the image is scanned as before.
+
+<<[[thresh_avg]] Function>>=
+struct ThreshHistogram {
+  std::vector<uint64_t> count, sum;  // Prefix sums over values below each index
+};
+
+template <typename T>
+bool thresh_histogram(const cv::Mat_<T>& mat, ThreshHistogram* hist) {
+  return false;
+}
+
+ThreshHistogram prefix_histogram(const std::vector<uint64_t>& counts) {
+  ThreshHistogram hist;
+  hist.count.assign(counts.size() + 1, 0);
+  hist.sum.assign(counts.size() + 1, 0);
+  for (int v = 0; v < counts.size(); ++v) {
+    hist.count[v+1] = hist.count[v] + counts[v];
+    hist.sum[v+1] = hist.sum[v] + counts[v] * v;
+  }
+  return hist;
+}
+
+bool thresh_histogram(const cv::Mat_<uint8_t>& mat, ThreshHistogram* hist) {
+  std::vector<uint64_t> counts(256, 0);
+  std::mutex merge_lock;
+  parallel_rows(mat.rows, [&](int begin, int end) {
+    std::vector<uint64_t> local_counts(256, 0);
+    for (int y = begin; y < end; ++y) {
+      const uint8_t* row = mat[y];
+      for (int x = 0; x < mat.cols; ++x)
+        ++local_counts[row[x]];
+    }
+    std::lock_guard<std::mutex> lock(merge_lock);
+    for (int v = 0; v < 256; ++v)
+      counts[v] += local_counts[v];
+  });
+
+  *hist = prefix_histogram(counts);
+  return true;
+}
+
+template <typename T>
+std::pair<double, double> thresh_avg(const ThreshHistogram& hist, T thresh) {
+  double below_cnt = hist.count[thresh], below_sum = hist.sum[thresh];
+  double above_cnt = hist.count.back() - hist.count[thresh],
+         above_sum = hist.sum.back() - hist.sum[thresh];
+  double above_avg = (above_cnt > 0) ? above_sum / above_cnt
+                                     : std::numeric_limits<T>::max();
+  double below_avg = (below_cnt > 0) ? below_sum / below_cnt
+                                     : std::numeric_limits<T>::min();
+  return std::make_pair(above_avg, below_avg);
+}
+
 @ Then the [[adaptive_theshold]] perform the iteration of threshold updating and checking for convergence.
+The [[engine]] chooses between scanning the image and using the histogram; by default the histogram is used whenever it is available.
 
 <<[[adaptive_theshold]] Function>>=
 <<[[thresh_avg]] Function>>
 
+enum ThreshEngine {
+  AUTO = 0,
+  SCAN = 1,
+  HISTOGRAM = 2
+};
+
 template <typename T>
-std::vector<T> adaptive_theshold(const cv::Mat_<T> mat) {
+std::vector<T> threshold_iteration(const std::function<std::pair<double, double>(T)>& means_at) {
   const double tolerance = 0.01;
   std::vector<T> thresholds;
   thresholds.push_back(std::numeric_limits<T>::max() / 2);
   T prev;
   do {
     prev = thresholds.back();
-    std::pair<double, double> means = thresh_avg(mat, prev);
+    std::pair<double, double> means = means_at(prev);
     thresholds.push_back((means.first + means.second) / 2);
   } while (abs(thresholds.back() - prev) > tolerance);
   return thresholds;
 }
 
+template <typename T>
+std::vector<T> adaptive_theshold(const cv::Mat_<T> mat, ThreshEngine engine=ThreshEngine::AUTO) {
+  ThreshHistogram hist;
+  bool use_hist = engine != ThreshEngine::SCAN && thresh_histogram(mat, &hist);
+  if (engine == ThreshEngine::HISTOGRAM && !use_hist) {
+    std::cerr << "ERROR: histogram engine requires an 8 bit image" << std::endl;
+    return std::vector<T>();
+  }
+  return threshold_iteration<T>([&](T thresh) {
+    return use_hist ? thresh_avg(hist, thresh) : thresh_avg(mat, thresh);
+  });
+}
+
+@ The same prefix sums give the threshold of Otsu's method, which picks the threshold $t$ maximizing the variance between the two classes,
+\[ \sigma_B^2(t) \propto \frac{\left(\mu \, \omega(t) - s(t)\right)^2}{\omega(t) \left(N - \omega(t)\right)}, \]
+where $\omega(t)$ and $s(t)$ are the count and sum of pixels below $t$, $N$ the number of pixels, and $\mu$ their mean.
+
+<<[[adaptive_theshold]] Function>>=
+uint8_t otsu_threshold(const cv::Mat_<uint8_t>& mat) {
+  ThreshHistogram hist;
+  thresh_histogram(mat, &hist);
+  double total_cnt = hist.count.back(), mean = hist.sum.back() / std::max(1.0, total_cnt);
+  double best = -1;
+  uint8_t best_thresh = 0;
+  for (int t = 1; t < 256; ++t) {
+    double below_cnt = hist.count[t];
+    if (below_cnt == 0 || below_cnt == total_cnt)
+      continue;
+    double diff = mean * below_cnt - hist.sum[t];
+    double between = diff * diff / (below_cnt * (total_cnt - below_cnt));
+    if (between > best) {
+      best = between;
+      best_thresh = t;
+    }
+  }
+  return best_thresh;
+}
+
 @ Finally, the [[threshold]] function performs the thresholding operation for a specific threshold.
-This function is provided for visualizing the results of the adaptive threshold operation.
+This function is provided for visualizing the results of the adaptive threshold operation, and processes rows in parallel with [[parallel_rows]].
+For 8 bit, 16 bit, and float images, [[threshold_row_simd]] compares a vector of pixels at a time with OpenCV's universal intrinsics and chooses between the two constants with [[v_select]].
+The pixels left over at the end of a row, the rows of other types, and every row when OpenCV is built without SIMD support ([[CV_SIMD128]] is 0) are compared one pixel at a time.
+The overload taking a map of [[thresholds]] compares each pixel to its own threshold in the same way.
 
 <<[[threshold]] Function>>=
+// Thresholds the first pixels of a row with SIMD and returns how many were done
+template <typename T>
+int threshold_row_simd(const T* in, const T* thresh, T threshold, T* out, int cols) {
+  return 0;
+}
+
+#if CV_SIMD128
+inline cv::v_uint8x16 thresh_setall(uint8_t v) { return cv::v_setall_u8(v); }
+inline cv::v_uint16x8 thresh_setall(uint16_t v) { return cv::v_setall_u16(v); }
+inline cv::v_float32x4 thresh_setall(float v) { return cv::v_setall_f32(v); }
+
+template <typename T>
+int threshold_row_vec(const T* in, const T* thresh, T threshold, T* out, int cols) {
+  typedef decltype(thresh_setall(T())) V;
+  const V high = thresh_setall(std::numeric_limits<T>::max()),
+          low = thresh_setall(std::numeric_limits<T>::min()),
+          uniform = thresh_setall(threshold);
+  int x = 0;
+  if (thresh) {
+    for (; x + V::nlanes <= cols; x += V::nlanes)
+      cv::v_store(out + x, cv::v_select(cv::v_load(in + x) >= cv::v_load(thresh + x), high, low));
+  } else {
+    for (; x + V::nlanes <= cols; x += V::nlanes)
+      cv::v_store(out + x, cv::v_select(cv::v_load(in + x) >= uniform, high, low));
+  }
+  return x;
+}
+
+inline int threshold_row_simd(const uint8_t* in, const uint8_t* thresh, uint8_t threshold,
+                              uint8_t* out, int cols) {
+  return threshold_row_vec(in, thresh, threshold, out, cols);
+}
+
+inline int threshold_row_simd(const uint16_t* in, const uint16_t* thresh, uint16_t threshold,
+                              uint16_t* out, int cols) {
+  return threshold_row_vec(in, thresh, threshold, out, cols);
+}
+
+inline int threshold_row_simd(const float* in, const float* thresh, float threshold,
+                              float* out, int cols) {
+  return threshold_row_vec(in, thresh, threshold, out, cols);
+}
+#endif
+
 template <typename T>
 cv::Mat_<T> threshold(cv::Mat_<T> mat, T threshold) {
+  const T high = std::numeric_limits<T>::max(), low = std::numeric_limits<T>::min();
   cv::Mat_<T> result(mat.size());
-  for (int y = 0; y < mat.rows; ++y) {
-    for (int x = 0; x < mat.cols; ++x) {
-      result(y, x) = (mat(y, x) >= threshold) ? std::numeric_limits<T>::max()
-                                              : std::numeric_limits<T>::min();
+  parallel_rows(mat.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      const T* in = mat[y];
+      T* out = result[y];
+      int x = threshold_row_simd(in, (const T*) nullptr, threshold, out, mat.cols);
+      for (; x < mat.cols; ++x)
+        out[x] = (in[x] >= threshold) ? high : low;
     }
-  }
+  });
   return result;
 }
 
+template <typename T>
+cv::Mat_<T> threshold(cv::Mat_<T> mat, const cv::Mat_<T>& thresholds) {
+  const T high = std::numeric_limits<T>::max(), low = std::numeric_limits<T>::min();
+  cv::Mat_<T> result(mat.size());
+  parallel_rows(mat.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      const T* in = mat[y];
+      const T* thresh = thresholds[y];
+      T* out = result[y];
+      int x = threshold_row_simd(in, thresh, (T) 0, out, mat.cols);
+      for (; x < mat.cols; ++x)
+        out[x] = (in[x] >= thresh[x]) ? high : low;
+    }
+  });
+  return result;
+}
+
+@ A single threshold fails on unevenly lit images, where the background in one part is darker than the foreground in another.
+The [[local_threshold]] function instead computes a threshold for each tile of [[tile]] by [[tile]] pixels, by running the same iteration on the histogram of a [[window]] by [[window]] region centered on the tile.
+Windows larger than the tiles overlap, which smooths the changes in threshold from tile to tile.
+
+The histogram of each window is not counted from scratch.
+Each row of tiles slides its window from left to right, removing the columns which leave the window and adding those which enter it, so each pixel is counted only about [[window / tile]] times per row of tiles.
+Rows of tiles are independent and run in parallel.
+
+A window which holds only background, such as a blank stretch of paper, has no second class of pixels, so the iteration would settle halfway between the background and one end of the range and mark the noise in the paper as foreground.
+Windows whose values span less than [[LOCAL_MIN_CONTRAST]] levels are therefore given the adaptive threshold of the whole image instead.
+The window must be at least as large as the tile, so that every pixel lies in the window of its own tile.
+
+The threshold of each pixel is then interpolated bilinearly between the thresholds of the four nearest tile centers, and clamped to the outermost centers near the image border.
+The resulting map of thresholds is applied by the overload of [[threshold]] which compares each pixel to its own threshold.
+
+<<[[local_threshold]] Function>>=
+const int LOCAL_TILE = 64;
+const int LOCAL_MIN_CONTRAST = 32;
+
+cv::Mat_<float> tile_thresholds(const cv::Mat_<uint8_t>& mat, const int tile, const int window) {
+  const int grid_rows = (mat.rows + tile - 1) / tile,
+            grid_cols = (mat.cols + tile - 1) / tile;
+  cv::Mat_<float> grid(grid_rows, grid_cols);
+
+  ThreshHistogram global_hist;
+  thresh_histogram(mat, &global_hist);
+  const float global_thresh = threshold_iteration<uint8_t>([&](uint8_t thresh) {
+    return thresh_avg(global_hist, thresh);
+  }).back();
+
+  parallel_rows(grid_rows, [&](int begin, int end) {
+    for (int gy = begin; gy < end; ++gy) {
+      int center_y = gy * tile + tile / 2;
+      int y0 = std::max(0, center_y - window / 2),
+          y1 = std::min(mat.rows, center_y + (window + 1) / 2);
+
+      std::vector<uint64_t> counts(256, 0);
+      int x0 = 0, x1 = 0;  // Columns [x0, x1) are counted
+      for (int gx = 0; gx < grid_cols; ++gx) {
+        int center_x = gx * tile + tile / 2;
+        int next_x0 = std::max(0, center_x - window / 2),
+            next_x1 = std::min(mat.cols, center_x + (window + 1) / 2);
+        for (int y = y0; y < y1; ++y) {
+          const uint8_t* row = mat[y];
+          for (int x = x0; x < std::min(next_x0, x1); ++x)
+            --counts[row[x]];
+          for (int x = std::max(x1, next_x0); x < next_x1; ++x)
+            ++counts[row[x]];
+        }
+        x0 = next_x0;
+        x1 = next_x1;
+
+        int lowest = 0, highest = 255;
+        while (lowest < 255 && counts[lowest] == 0)
+          ++lowest;
+        while (highest > lowest && counts[highest] == 0)
+          --highest;
+        if (highest - lowest < LOCAL_MIN_CONTRAST) {
+          grid(gy, gx) = global_thresh;
+          continue;
+        }
+
+        ThreshHistogram hist = prefix_histogram(counts);
+        grid(gy, gx) = threshold_iteration<uint8_t>([&](uint8_t thresh) {
+          return thresh_avg(hist, thresh);
+        }).back();
+      }
+    }
+  });
+  return grid;
+}
+
+cv::Mat_<uint8_t> local_threshold(const cv::Mat_<uint8_t>& mat, const int tile=LOCAL_TILE,
+                                  const int window=2*LOCAL_TILE) {
+  if (tile < 1 || window < tile) {
+    std::cerr << "ERROR: local threshold window " << window << " must be at least the tile size "
+              << tile << ", which must be positive" << std::endl;
+    return cv::Mat_<uint8_t>();
+  }
+  cv::Mat_<float> grid = tile_thresholds(mat, tile, window);
+  cv::Mat_<uint8_t> thresholds(mat.size());
+
+  // Position of a pixel in the grid of tile centers, clamped to the outermost centers
+  auto grid_pos = [tile](int p, int n, int* g0, int* g1, float* w) {
+    float pos = std::min(std::max((p - tile / 2) / (float) tile, 0.0f), (float) (n - 1));
+    *g0 = (int) pos;
+    *g1 = std::min(*g0 + 1, n - 1);
+    *w = pos - *g0;
+  };
+
+  parallel_rows(mat.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      int gy0, gy1;
+      float wy;
+      grid_pos(y, grid.rows, &gy0, &gy1, &wy);
+      for (int x = 0; x < mat.cols; ++x) {
+        int gx0, gx1;
+        float wx;
+        grid_pos(x, grid.cols, &gx0, &gx1, &wx);
+        float top = (1 - wx) * grid(gy0, gx0) + wx * grid(gy0, gx1),
+              bottom = (1 - wx) * grid(gy1, gx0) + wx * grid(gy1, gx1);
+        thresholds(y, x) = cv::saturate_cast<uint8_t>((1 - wy) * top + wy * bottom);
+      }
+    }
+  });
+  return thresholds;
+}
+
 @ \subsection*{Implementation of [[main]]}
 
 In the [[main]] function, we use the [[adaptive_theshold]] operation on three images and record the intermediate threshold values.
+The Otsu threshold of each image is printed for comparison.
+Called as [[Q2 batch <pattern> <out_dir> [threads] [local|packed]]], it thresholds every matching image at its adaptive threshold, or at its local thresholds if [[local]] is given, with [[run_batch]].
+With [[packed]], the adaptive threshold is applied with [[threshold_packed]], which stores the result one bit per pixel while it is computed and only expands it with [[unpack_mask]] for the PNG encoder.
+Called as [[Q2 stream <input> <output> [threshold] [band_rows]]], it instead thresholds a large image at a fixed value using [[stream_bands]].
 
 <<Q2.cpp>>=
 <<Include>>
-<<Global constants>>
+<<[[png_write]] Function>>
 <<[[im_load]] Function>>
+<<[[parallel_rows]] Function>>
+<<[[stream_bands]] Function>>
 <<[[adaptive_theshold]] Function>>
 <<[[threshold]] Function>>
+<<[[local_threshold]] Function>>
+<<[[PackedMask]] Function>>
+<<[[run_batch]] Function>>
 
 int main(int argc, char* argv[]) {
+  <<Thread count>>
+  if (argc >= 4 && std::string("batch") == argv[1]) {
+    int threads = (argc >= 5) ? std::atoi(argv[4]) : 0;
+    bool local = argc >= 6 && std::string("local") == argv[5],
+         packed = argc >= 6 && std::string("packed") == argv[5];
+    return run_batch(argv[2], argv[3], threads,
+                     [local, packed](const cv::Mat_<uint8_t>& image) -> cv::Mat {
+      if (local) {
+        cv::Mat_<uint8_t> thresholds = local_threshold(image);
+        return thresholds.empty() ? cv::Mat() : threshold(image, thresholds);
+      }
+      if (packed)
+        return unpack_mask(threshold_packed(image, adaptive_theshold(image).back()));
+      return threshold(image, adaptive_theshold(image).back());
+    });
+  }
+
+  if (argc >= 4 && std::string("stream") == argv[1]) {
+    uint8_t thresh = (argc >= 5) ? std::atoi(argv[4]) : 128;
+    int band_rows = (argc >= 6) ? std::atoi(argv[5]) : STREAM_BAND_ROWS;
+    bool success = stream_bands(argv[2], argv[3], cv::IMREAD_GRAYSCALE, band_rows, 0,
+        [&](const cv::Mat& band) -> cv::Mat {
+          return threshold(cv::Mat_<uint8_t>(band), thresh);
+        });
+    return success ? 0 : 1;
+  }
+
   <<Command line args>>
 
   const int n_images = 3;
@@ -94,10 +409,12 @@ int main(int argc, char* argv[]) {
   for (int i = 0; i < n_images; ++i) {
     std::vector<uint8_t> thresh_iter = adaptive_theshold(images[i]);
     thresholds.push_back(thresh_iter);
+    std::cout << "Image " << i+1 << ": adaptive threshold " << (int) thresh_iter.back()
+              << ", Otsu threshold " << (int) otsu_threshold(images[i]) << std::endl;
     if (thresh_iter.size() > max_size)
       max_size = thresh_iter.size();
-    cv::imwrite(path + "/output/thresh_" + std::to_string(i+1) + ".png",
-                threshold(images[i], thresh_iter.back()));
+    png_write(path + "/output/thresh_" + std::to_string(i+1) + ".png",
+              threshold(images[i], thresh_iter.back()));
   }
 
   std::ofstream thresh_csv;
@@ -6,15 +6,23 @@ This section provides several insignificant code snippets which are used by the
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 
 #include <iostream>
 #include <cmath>
 #include <set>
 #include <limits>
 #include <fstream>
-
-<<Global constants>>=
-const std::vector<int> PNG_COMPRESSION = {CV_IMWRITE_PNG_COMPRESSION, 9};
+#include <cstdlib>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <random>
 
 <<Command line args>>=
 std::string path;
@@ -32,6 +40,12 @@ if (argc == 2 || (argc == 3 && std::string("display") == argv[2])) {
 }
 path = argv[1];
 
+@ Every [[main]] first applies the thread count set in the environment variable [[CSCE590_THREADS]], before choosing between its modes, so it also limits the batch and stream modes.
+
+<<Thread count>>=
+if (std::getenv("CSCE590_THREADS"))
+  cv::setNumThreads(std::atoi(std::getenv("CSCE590_THREADS")));
+
 <<[[im_load]] Function>>=
 template<typename T>
 bool im_load(const std::string& im_path, cv::Mat_<T>* mat, int mode=cv::IMREAD_COLOR) {
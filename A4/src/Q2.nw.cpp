@@ -3,20 +3,62 @@
 In part 2, we use the Hough transform to detect the longest linear edges in an image.
 
 We begin by using the Sobel detection mechanism built into OpenCV and a threshold to get a binary image of candidate edges.
+If [[angles]] is not null, the direction of the gradient at each pixel, in radians in $[0, 2\pi)$, is also returned through it.
+
+Most pixels of the result are not edges, so [[edge_detect]] can also return the edge pixels in an [[EdgeList]].
+It keeps the coordinates, and the gradient directions if [[with_angles]] is set, each in its own contiguous array, so that loops over the edges read nothing but edge data.
+The size of the image the edges come from sets the range of $\rho$ in the transform, so it is required to construct the list.
 
 <<[[edge_detect]] Function>>=
+struct EdgeList {
+  explicit EdgeList(const cv::Size& image_size, const bool with_angles=false)
+      : with_angles(with_angles), image_size(image_size) {}
+
+  void push_back(const int x_i, const int y_i, const float angle_i=0) {
+    x.push_back(x_i);
+    y.push_back(y_i);
+    if (with_angles)
+      angle.push_back(angle_i);
+  }
+  size_t size() const { return x.size(); }
+
+  bool with_angles;
+  cv::Size image_size;
+  std::vector<int> x, y;
+  std::vector<float> angle;
+};
+
 template <typename T>
-cv::Mat_<T> edge_detect(const cv::Mat_<T>& I, const double thresh=0.7) {
+cv::Mat_<T> edge_detect(const cv::Mat_<T>& I, const double thresh=0.7,
+                        cv::Mat_<float>* angles=nullptr, EdgeList* list=nullptr) {
   cv::Mat_<double> dx, dy, edges_db;
   cv::Mat_<T> edges;
   cv::Sobel(I, dx, cv::DataType<double>::type, 1, 0);
   cv::Sobel(I, dy, cv::DataType<double>::type, 0, 1);
+  if (angles) {
+    cv::Mat_<double> phase;
+    cv::phase(dx, dy, phase);
+    phase.convertTo(*angles, cv::DataType<float>::type);
+  }
   cv::magnitude(dx, dy, edges_db);
   edges_db.convertTo(edges, cv::DataType<T>::type);
   double min_v, max_v;
   cv::minMaxLoc(edges, &min_v, &max_v);
   cv::threshold(edges, edges, min_v + thresh * (max_v - min_v),
                 std::numeric_limits<T>::max(), cv::THRESH_BINARY);
+
+  if (list) {
+    *list = EdgeList(edges.size(), list->with_angles);
+    for (int y = 0; y < edges.rows; ++y) {
+      const T* row = edges[y];
+      for (int x = 0; x < edges.cols; ++x) {
+        if (row[x] > 0) {
+          float angle = list->with_angles ? atan2(dy(y, x), dx(y, x)) : 0;
+          list->push_back(x, y, angle < 0 ? angle + 2 * M_PI : angle);
+        }
+      }
+    }
+  }
   return edges;
 }
 
@@ -24,11 +66,47 @@ cv::Mat_<T> edge_detect(const cv::Mat_<T>& I, const double thresh=0.7) {
 For each pixel $I(y,x) > 0$ where $I$ is the original image, we increment each pixel $P(\rho,\theta)$ in the the sinusoidal waveform defined by $x\cos\theta + y\sin\theta = \rho$ for $\theta \in \left[-\pi,\pi\right]$.
 The resulting matrix $P$ is returned.
 
+The voting is done on an [[EdgeList]], either given directly from [[edge_detect]] or gathered from the edges given as an image or as a [[PackedMask]]; for the latter, bytes without any edge pixel are skipped eight pixels at a time.
+The values of $\cos\theta$ and $\sin\theta$ for each bin are computed once by [[HoughTables]] rather than for every edge pixel; they are the same values, so the votes do not change.
+
+A line through an edge pixel is roughly perpendicular to the gradient there, so its normal angle $\theta$ is close to the direction of the gradient, modulo $\pi$.
+If the gradient directions from [[edge_detect]] are given, in [[angles]] or in the [[EdgeList]], each edge pixel only votes for the bins within [[angle_window]] of its direction, instead of for all of them.
+The bins wrap around, since $\theta = -\frac{\pi}{2}$ and $\theta = \frac{\pi}{2}$ describe the same line with opposite $\rho$.
+
+The columns of the accumulator are split across threads with [[parallel_rows]], in one stripe per thread.
+Each thread votes only in its own range of $\theta$, intersecting the window of each pixel with that range, so no two threads write the same bin and no locking is needed.
+A window covers at most all the bins once, so no pixel votes twice in one bin.
+Without gradient directions every stripe goes through every edge pixel; with them, the pixels are first sorted by the bin their window starts in with a counting sort, and each stripe only goes through those whose window, possibly wrapping around the last bin, meets its range.
+The votes are counted in 32 bit integers and converted to [[T_out]] at the end with saturation, so a bin with more votes than [[T_out]] can hold is clamped to its maximum rather than wrapping around.
+The result is the same as voting serially, whatever the number of threads.
+
 <<[[hough_transform]] Function>>=
-template <typename T_out, typename T_in>
-cv::Mat_<T_out> hough_transform(const cv::Mat_<T_in>& E, const int theta_bins=600,
-                                const int rho_bins=600, double* max_rho_ptr=nullptr) {
-  const int max_rho = std::max(E.rows, E.cols) * 1.05;
+const double HOUGH_ANGLE_WINDOW = M_PI / 36;
+
+struct HoughTables {
+  HoughTables(const int theta_bins, const double max_theta)
+      : cos_theta(theta_bins), sin_theta(theta_bins) {
+    const double d_theta = 2.0 * max_theta / theta_bins;
+    for (int theta_i = 0; theta_i < theta_bins; ++theta_i) {
+      double theta = d_theta * theta_i - max_theta;
+      cos_theta[theta_i] = cos(theta);
+      sin_theta[theta_i] = sin(theta);
+    }
+  }
+
+  std::vector<double> cos_theta, sin_theta;
+};
+
+template <typename T_out>
+cv::Mat_<T_out> hough_transform(const EdgeList& edges, const int theta_bins=600,
+                                const int rho_bins=600, double* max_rho_ptr=nullptr,
+                                const double angle_window=HOUGH_ANGLE_WINDOW) {
+  const cv::Size& size = edges.image_size;
+  if (size.width <= 0 || size.height <= 0) {
+    std::cerr << "ERROR: edge list has no image size" << std::endl;
+    return cv::Mat_<T_out>();
+  }
+  const int max_rho = std::max(size.height, size.width) * 1.05;
   const double max_theta = M_PI/2;
 
   const double d_theta = 2.0 * max_theta / theta_bins,
@@ -37,71 +115,192 @@ cv::Mat_<T_out> hough_transform(const cv::Mat_<T_in>& E, const int theta_bins=60
   if (max_rho_ptr)
     *max_rho_ptr = max_rho;
 
-  cv::Mat_<T_out> parametric = cv::Mat_<T_out>::zeros(rho_bins, theta_bins);
+  const HoughTables tables(theta_bins, max_theta);
+  const int window_bins = std::min((theta_bins - 1) / 2, (int) ceil(angle_window / d_theta)),
+            span = 2 * window_bins + 1;
+
+  const bool restricted = edges.with_angles;
+  std::vector<int> windows;  // First bin voted by each point when restricted by angles
+  std::vector<int> by_window, window_start;  // Points sorted by first bin, and where each bin starts
+  if (restricted) {
+    windows.resize(edges.size());
+    window_start.assign(theta_bins + 1, 0);
+    for (size_t p = 0; p < edges.size(); ++p) {
+      double theta = fmod(edges.angle[p] + max_theta, M_PI);  // Normal angle plus max_theta in [0, pi)
+      windows[p] = ((int) (theta / d_theta) - window_bins + theta_bins) % theta_bins;
+      ++window_start[windows[p] + 1];
+    }
+    std::partial_sum(window_start.begin(), window_start.end(), window_start.begin());
+    by_window.resize(edges.size());
+    std::vector<int> next(window_start.begin(), window_start.end() - 1);
+    for (size_t p = 0; p < edges.size(); ++p)
+      by_window[next[windows[p]]++] = p;
+  }
+
+  cv::Mat_<int> votes = cv::Mat_<int>::zeros(rho_bins, theta_bins);
+  auto vote = [&](const int x, const int y, const int first, const int last) {
+    for (int theta_i = first; theta_i <= last; ++theta_i) {
+      double rho = x * tables.cos_theta[theta_i] + y * tables.sin_theta[theta_i];
+      int rho_i = (rho + max_rho) / d_rho;
+
+      if (rho_i < 0 || rho_i >= votes.rows)
+        continue;
+
+      ++votes(rho_i, theta_i);
+    }
+  };
+
+  // Votes for the points whose windows start in bins [first_w, last_w], within the stripe
+  auto vote_windows = [&](const int first_w, const int last_w, const int begin, const int end) {
+    for (int k = window_start[first_w]; k < window_start[last_w + 1]; ++k) {
+      const int p = by_window[k];
+      // The window may wrap past the last bin, so it is clipped to the stripe once as it is
+      // and once shifted back by a full turn of bins
+      for (int shift = -theta_bins; shift <= 0; shift += theta_bins) {
+        int first = std::max(windows[p] + shift, begin),
+            last = std::min(windows[p] + span - 1 + shift, end - 1);
+        if (first <= last)
+          vote(edges.x[p], edges.y[p], first, last);
+      }
+    }
+  };
+
+  parallel_rows(theta_bins, [&](int begin, int end) {
+    if (!restricted) {
+      for (size_t p = 0; p < edges.size(); ++p)
+        vote(edges.x[p], edges.y[p], begin, end - 1);
+      return;
+    }
+    // A window meets the stripe if it starts in [low, end), or if it wraps and starts at or after wrap_low
+    const int low = std::max(0, begin - span + 1),
+              wrap_low = begin + theta_bins - span + 1;
+    if (wrap_low <= end) {
+      vote_windows(low, theta_bins - 1, begin, end);
+    } else {
+      vote_windows(low, end - 1, begin, end);
+      if (wrap_low < theta_bins)
+        vote_windows(wrap_low, theta_bins - 1, begin, end);
+    }
+  }, cv::getNumThreads());
+
+  cv::Mat_<T_out> parametric;
+  votes.convertTo(parametric, cv::DataType<T_out>::type);  // Saturates
+  return parametric;
+}
+
+template <typename T_out, typename T_in>
+cv::Mat_<T_out> hough_transform(const cv::Mat_<T_in>& E, const int theta_bins=600,
+                                const int rho_bins=600, double* max_rho_ptr=nullptr,
+                                const cv::Mat_<float>* angles=nullptr,
+                                const double angle_window=HOUGH_ANGLE_WINDOW) {
+  EdgeList edges(E.size(), angles != nullptr);
   for (int y = 0; y < E.rows; ++y) {
     for (int x = 0; x < E.cols; ++x) {
-      T_in val = E(y, x);
-      if (val > 0) {
-        for (int theta_i = 0; theta_i < parametric.cols; ++theta_i) {
-          double theta = d_theta * theta_i - max_theta;
-          double rho = x * cos(theta) + y * sin(theta);
-          int rho_i = (rho + max_rho) / d_rho;
-
-          if (rho_i < 0 || rho_i >= parametric.rows) {
-            // std::cout << "WARN: rho = " << rho_i << " " << rho
-            //           << " out of bounds [0, " << parametric.rows << ")"
-            //           << std::endl;
-            rho_i = parametric.rows-1;
-            continue;
-          }
-
-          ++parametric(rho_i, theta_i);
-        }
-      }
+      if (E(y, x) > 0)
+        edges.push_back(x, y, angles ? (*angles)(y, x) : 0);
     }
   }
+  return hough_transform<T_out>(edges, theta_bins, rho_bins, max_rho_ptr, angle_window);
+}
 
-  return parametric;
+template <typename T_out>
+cv::Mat_<T_out> hough_transform(const PackedMask& E, const int theta_bins=600,
+                                const int rho_bins=600, double* max_rho_ptr=nullptr,
+                                const cv::Mat_<float>* angles=nullptr,
+                                const double angle_window=HOUGH_ANGLE_WINDOW) {
+  EdgeList edges(E.size(), angles != nullptr);
+  for (int y = 0; y < E.rows; ++y) {
+    const uint8_t* bits = E.row(y);
+    for (int b = 0; b < E.stride; ++b) {
+      for (int k = 0; bits[b] >> k; ++k) {
+        if ((bits[b] >> k) & 1)
+          edges.push_back(8 * b + k, y, angles ? (*angles)(y, 8 * b + k) : 0);
+      }
+    }
+  }
+  return hough_transform<T_out>(edges, theta_bins, rho_bins, max_rho_ptr, angle_window);
 }
 
 @ In the [[hough_lines]] function, we operate on the result of the [[hough_transform]] function to find strongest lines.
 The first step is to identify the $n$ most intense pixels $P(i_\rho, i_\theta)$ where $P$ is the input matrix.
+A line gives a peak spread over several neighbouring bins, so a bin is only a candidate if it is the maximum of the square of radius [[nms_radius]] around it, which is found for all bins at once by a dilation.
+The candidates are put in a heap and taken from the strongest, skipping any within [[nms_radius]] of one already taken, until there are $n$.
+The $\theta$ axis wraps around, since the line at $\theta$ and $\rho$ is the line at $\theta + \pi$ and $-\rho$, and flipping the rows of the accumulator negates $\rho$.
+So before dilating, the accumulator is padded on each side with the flipped columns from the other end, and two bins near opposite ends are also compared with the $\rho$ of one flipped.
+This way the cost hardly depends on $n$, and the lines returned, strongest first, are distinct.
 For each $(i_\rho, i_\theta)$, we convert back to the original ranges of $\rho$ and $\theta$, thus returning the pairs
 \[\left( \frac{2 i_\rho \rho_{max}}{N_\rho} - \rho_{max}, \frac{2 i_\theta \theta_{max}}{N_\theta} - \theta_{max} \right).\]
 
 <<[[hough_lines]] Function>>=
+const int HOUGH_NMS_RADIUS = 5;
+
 template <typename T_in>
 std::vector<cv::Point_<double> > hough_lines(const cv::Mat_<T_in>& hough,
                       const double max_rho, const int n,
-                      std::vector<cv::Point_<T_in> >* point_indices=nullptr) {
+                      std::vector<cv::Point_<T_in> >* point_indices=nullptr,
+                      const int nms_radius=HOUGH_NMS_RADIUS) {
   const double max_theta = M_PI/2;
-  std::vector<std::pair<cv::Point_<T_in>, T_in> > max_vals;
+  typedef std::pair<T_in, cv::Point> Peak;
+
+  const int pad = std::min(nms_radius, hough.cols);
+  cv::Mat_<T_in> flipped, wrapped(hough.rows, hough.cols + 2 * pad), dilated;
+  cv::flip(hough, flipped, 0);
+  flipped.colRange(hough.cols - pad, hough.cols).copyTo(wrapped.colRange(0, pad));
+  hough.copyTo(wrapped.colRange(pad, pad + hough.cols));
+  flipped.colRange(0, pad).copyTo(wrapped.colRange(pad + hough.cols, wrapped.cols));
+
+  cv::Mat_<uint8_t> is_max;
+  cv::dilate(wrapped, dilated, cv::getStructuringElement(cv::MORPH_RECT,
+             cv::Size(2 * nms_radius + 1, 2 * nms_radius + 1)));
+  cv::compare(hough, dilated.colRange(pad, pad + hough.cols), is_max, cv::CMP_EQ);
+
+  std::vector<Peak> peaks;
   for (int rho_i = 0; rho_i < hough.rows; ++rho_i) {
+    const T_in* row = hough[rho_i];
+    const uint8_t* max_row = is_max[rho_i];
     for (int theta_i = 0; theta_i < hough.cols; ++theta_i) {
-      T_in v = hough(rho_i, theta_i);
-      int i;
-      for (i = 0; i < max_vals.size() && v > max_vals[i].second; ++i) {}
-      if (i > 0 || max_vals.size() == 0) {
-        max_vals.insert(max_vals.begin() + i,
-                        std::make_pair(cv::Point_<double>(theta_i, rho_i), v));
-        if (max_vals.size() > n)
-          max_vals.erase(max_vals.begin());
-      }
+      if (max_row[theta_i] && row[theta_i] > 0)
+        peaks.push_back(std::make_pair(row[theta_i], cv::Point(theta_i, rho_i)));
+    }
+  }
+
+  // Weaker peaks first, and later bins first among equal peaks
+  auto weaker = [](const Peak& a, const Peak& b) {
+    if (a.first != b.first)
+      return a.first < b.first;
+    return (a.second.y != b.second.y) ? a.second.y > b.second.y : a.second.x > b.second.x;
+  };
+  std::make_heap(peaks.begin(), peaks.end(), weaker);
+
+  std::vector<cv::Point> max_locs;
+  while (!peaks.empty() && max_locs.size() < n) {
+    std::pop_heap(peaks.begin(), peaks.end(), weaker);
+    cv::Point loc = peaks.back().second;
+    peaks.pop_back();
+
+    bool suppressed = false;
+    for (int i = 0; i < max_locs.size() && !suppressed; ++i) {
+      int d_theta = std::abs(max_locs[i].x - loc.x);
+      suppressed = (d_theta <= nms_radius && std::abs(max_locs[i].y - loc.y) <= nms_radius)
+                || (hough.cols - d_theta <= nms_radius
+                    && std::abs(max_locs[i].y - (hough.rows - 1 - loc.y)) <= nms_radius);
     }
+    if (!suppressed)
+      max_locs.push_back(loc);
   }
 
   if (point_indices)
-    point_indices->resize(max_vals.size());
+    point_indices->resize(max_locs.size());
 
-  std::vector<cv::Point_<double> > lines(max_vals.size());
-  for (int i = 0; i < max_vals.size(); ++i) {
-    std::pair<cv::Point_<T_in>, T_in> line = max_vals[i];
-    cv::Point_<T_in> loc = line.first;
+  std::vector<cv::Point_<double> > lines(max_locs.size());
+  for (int i = 0; i < max_locs.size(); ++i) {
+    cv::Point loc = max_locs[i];
     double theta = loc.x * 2 * max_theta / hough.cols - max_theta;
     double rho = loc.y * 2 * max_rho / hough.rows - max_rho;
     lines[i] = cv::Point_<double>(theta, rho);
 
-    (*point_indices)[i] = loc;
+    if (point_indices)
+      (*point_indices)[i] = loc;
   }
   return lines;
 }
@@ -129,69 +328,268 @@ cv::Point_<double> xline(const cv::Point_<double>& polar_p) {
 }
 
 @ In the [[draw_line]] function, we calculate the longest segment of a line which is contained in the nonzero pixels of a binary mask.
-A small separation is allowed between pixels, allowing for more cohesive segments.
+Gaps of up to [[connect_thresh]] pixels missing from the mask are bridged, allowing for more cohesive segments.
 Lines are calculated either by [[xline]] if $\left|\sin\theta\right| \leq \frac{1}{\sqrt{2}}$ else by [[yline]].
+In the first case the line is walked along the rows instead of the columns, and the mask is looked up with swapped coordinates.
+At each step the other coordinate is rounded to the nearest pixel, so that a line along a row or column does not drift off it through rounding errors in the slope.
+The mask is given as a function [[mask_at]] of the row and column of the original image, which the overloads below provide for an image or a [[PackedMask]].
+The segment is found by [[longest_segment]], which returns it as a [[LineSegment]] giving the range [[start]] to [[end]] of the walked coordinate, so that it can also be used to go over the pixels of the segment; if no pixel of the line is set, [[end]] is before [[start]].
+The [[segment_from]] function instead walks out from a given pixel in both directions, as far as the gaps allow.
 
 <<[[draw_line]] Function>>=
-template <typename T_out, typename T_in>
-void draw_line(cv::Mat_<cv::Vec<T_out, 3> >* im, const cv::Mat_<T_in>& mask,
-               cv::Point_<double> polar_coords, const int connect_thresh=4) {
-  double theta = polar_coords.x,
-         rho = polar_coords.y;
-  bool xy = abs(sin(theta)) <= 1/sqrt(2);  // To fairly allocate
-
-  cv::Mat_<T_in> this_mask;
-  if (xy) {
-    cv::transpose(*im, *im);
-    cv::transpose(mask, this_mask);
-  } else {
-    this_mask = mask;
+struct LineSegment {
+  explicit LineSegment(const cv::Point_<double>& polar_coords)
+      : xy(abs(sin(polar_coords.x)) <= 1/sqrt(2)),  // To fairly allocate
+        mb(xy ? xline(polar_coords) : yline(polar_coords)), start(0), end(-1) {}
+
+  cv::Point at(const int u) const {
+    int v = cvRound(mb.x * u + mb.y);
+    return xy ? cv::Point(v, u) : cv::Point(u, v);
+  }
+
+  // Number of values of the walked coordinate in an image
+  int walk_length(const cv::Size& size) const { return xy ? size.height : size.width; }
+
+  // Whether the pixel at u is in the image and set in the mask
+  bool is_set(const cv::Size& size, const std::function<bool(int, int)>& mask_at,
+              const int u) const {
+    cv::Point q = at(u);
+    return q.x >= 0 && q.y >= 0 && q.x < size.width && q.y < size.height && mask_at(q.y, q.x);
   }
 
-  cv::Point_<double> mb = (xy) ? xline(polar_coords) : yline(polar_coords);
-  std::vector<int>  yvals(im->cols);
-  std::vector<bool> yvalids(im->cols);
-  for (int x = 0; x < yvals.size(); ++x) {
-    int y = mb.x * x + mb.y;
-    yvals[x] = y;
-    yvalids[x] = y >= 0 && y < im->rows && mask(y,x) > 0;
+  bool xy;  // Walked along the rows
+  cv::Point_<double> mb;
+  int start, end;
+};
+
+LineSegment longest_segment(const cv::Size& size, const std::function<bool(int, int)>& mask_at,
+                            cv::Point_<double> polar_coords, const int connect_thresh=4) {
+  LineSegment segment(polar_coords);
+  int run_start = 0, last_set = -1;
+  for (int u = 0; u < segment.walk_length(size); ++u) {
+    if (!segment.is_set(size, mask_at, u))
+      continue;
+    if (last_set < 0 || u - last_set - 1 > connect_thresh)
+      run_start = u;
+    last_set = u;
+    if (last_set - run_start > segment.end - segment.start) {
+      segment.start = run_start;
+      segment.end = last_set;
+    }
   }
+  return segment;
+}
 
-  int longest_start = 0, current_start = 0, longest = 0, recent = yvals.size();
-  for (int x = 0; x < yvals.size(); ++x) {
-    int valid = yvalids[x];
-    int length = x - current_start;
-    if (valid) {
-      if (x - recent <= connect_thresh) {
-        recent = x;
-        if (length > longest) {
-          longest = length;
-          longest_start = current_start;
-        }
+LineSegment segment_from(const cv::Size& size, const std::function<bool(int, int)>& mask_at,
+                         cv::Point_<double> polar_coords, const cv::Point& seed,
+                         const int connect_thresh=4) {
+  LineSegment segment(polar_coords);
+  const int u0 = segment.xy ? seed.y : seed.x;
+  segment.start = segment.end = u0;
+  for (int step = -1; step <= 1; step += 2) {
+    int gap = 0;
+    for (int u = u0 + step; u >= 0 && u < segment.walk_length(size) && gap <= connect_thresh;
+         u += step) {
+      if (!segment.is_set(size, mask_at, u)) {
+        ++gap;
+        continue;
       }
-    } else {
-      current_start = x;
+      gap = 0;
+      if (step < 0)
+        segment.start = u;
+      else
+        segment.end = u;
     }
   }
+  return segment;
+}
 
-  int x0 = longest_start,
-      x1 = longest_start + longest;
-  cv::line(*im, cv::Point(x0, yvals[x0]), cv::Point(x1, yvals[x1]),
+template <typename T_out>
+void draw_line(cv::Mat_<cv::Vec<T_out, 3> >* im, const std::function<bool(int, int)>& mask_at,
+               cv::Point_<double> polar_coords, const int connect_thresh=4) {
+  LineSegment segment = longest_segment(im->size(), mask_at, polar_coords, connect_thresh);
+  if (segment.end < segment.start)
+    return;
+  cv::line(*im, segment.at(segment.start), segment.at(segment.end),
            cv::Scalar(0, 0, std::numeric_limits<T_out>::max()), 2);
+}
 
-  if (xy)
-    cv::transpose(*im, *im);
+template <typename T_out, typename T_in>
+void draw_line(cv::Mat_<cv::Vec<T_out, 3> >* im, const cv::Mat_<T_in>& mask,
+               cv::Point_<double> polar_coords, const int connect_thresh=4) {
+  draw_line(im, [&](int y, int x) { return mask(y, x) > 0; }, polar_coords, connect_thresh);
+}
+
+template <typename T_out>
+void draw_line(cv::Mat_<cv::Vec<T_out, 3> >* im, const PackedMask& mask,
+               cv::Point_<double> polar_coords, const int connect_thresh=4) {
+  draw_line(im, [&](int y, int x) { return mask(y, x); }, polar_coords, connect_thresh);
+}
+
+@ For video, the lines of a frame are needed within a fixed time, which the full transform and [[hough_lines]] cannot promise.
+The [[hough_segments]] function is a progressive probabilistic Hough transform which finds line segments one at a time, so that it can stop as soon as it has [[n]] of them or [[budget_ms]] milliseconds have passed.
+The edge pixels vote in a random order, with a fixed seed so that the result only depends on the frame.
+After each vote, if the strongest bin the pixel voted for has reached [[min_votes]], the line at the angle of that bin which passes through the pixel itself is walked out from the pixel along the remaining edge pixels with [[segment_from]], bridging gaps of up to [[connect_thresh]] pixels as OpenCV's [[HoughLinesP]] does.
+Taking $\rho$ from the pixel rather than from the center of the bin keeps the seed on the walked line, where a bin up to $\frac{\Delta\rho}{2}$ away could start the walk beside it.
+The pixel is then removed from the remaining edges and its votes are taken back, whether or not the segment is kept, so that it cannot start the same walk again.
+A segment of at least [[min_length]] is returned, and its pixels, and those next to it, are also removed and their votes taken back, so that the same line is not found again.
+
+The [[min_votes]] argument trades accuracy for latency: a low value finds lines after very few votes, but more of them are noise or slightly off, while a high value needs more of the edges to vote before a line is accepted.
+Each segment is returned as its two end points $(x_0, y_0, x_1, y_1)$.
+
+<<[[hough_segments]] Function>>=
+const double HOUGH_BUDGET_MS = 30;
+const int HOUGH_MIN_VOTES = 50;
+
+std::vector<cv::Vec4i> hough_segments(const EdgeList& edges, const int n, const int min_votes,
+                                      const double budget_ms=HOUGH_BUDGET_MS,
+                                      const int min_length=20, const int connect_thresh=4,
+                                      const int theta_bins=600, const int rho_bins=600) {
+  int64 start = cv::getTickCount();
+  const cv::Size& size = edges.image_size;
+  if (size.width <= 0 || size.height <= 0) {
+    std::cerr << "ERROR: edge list has no image size" << std::endl;
+    return std::vector<cv::Vec4i>();
+  }
+  const int max_rho = std::max(size.height, size.width) * 1.05;
+  const double max_theta = M_PI/2;
+
+  const double d_theta = 2.0 * max_theta / theta_bins,
+               d_rho = 2.0 * max_rho / rho_bins;
+
+  const HoughTables tables(theta_bins, max_theta);
+  const int window_bins = std::min((theta_bins - 1) / 2, (int) ceil(HOUGH_ANGLE_WINDOW / d_theta));
+
+  cv::Mat_<int> remaining(size, -1);  // Index in edges of each edge pixel not yet removed
+  for (int p = 0; p < edges.size(); ++p)
+    remaining(edges.y[p], edges.x[p]) = p;
+  std::vector<bool> voted(edges.size(), false);
+
+  cv::Mat_<int> votes = cv::Mat_<int>::zeros(rho_bins, theta_bins);
+  // Adds delta to the bins of edge p, returning the strongest of them
+  auto vote = [&](const int p, const int delta) {
+    int first = 0, last = theta_bins - 1;
+    if (edges.with_angles) {
+      double theta = fmod(edges.angle[p] + max_theta, M_PI);  // Normal angle plus max_theta in [0, pi)
+      first = (int) (theta / d_theta) - window_bins;
+      last = first + 2 * window_bins;
+    }
+
+    cv::Point best(-1, -1);
+    for (int k = first; k <= last; ++k) {
+      int theta_i = (k + theta_bins) % theta_bins;
+      double rho = edges.x[p] * tables.cos_theta[theta_i] + edges.y[p] * tables.sin_theta[theta_i];
+      int rho_i = (rho + max_rho) / d_rho;
+      if (rho_i < 0 || rho_i >= votes.rows)
+        continue;
+
+      votes(rho_i, theta_i) += delta;
+      if (best.x < 0 || votes(rho_i, theta_i) > votes(best))
+        best = cv::Point(theta_i, rho_i);
+    }
+    return best;
+  };
+
+  std::vector<int> order(edges.size());
+  for (int p = 0; p < order.size(); ++p)
+    order[p] = p;
+  std::mt19937 rng(590);
+  std::shuffle(order.begin(), order.end(), rng);
+
+  std::vector<cv::Vec4i> segments;
+  for (int i = 0; i < order.size() && segments.size() < n; ++i) {
+    if (i % 64 == 0 && elapsed_ms(start) > budget_ms)
+      break;
+
+    const int p = order[i];
+    if (remaining(edges.y[p], edges.x[p]) < 0)
+      continue;
+    voted[p] = true;
+    cv::Point best = vote(p, 1);
+    if (best.x < 0 || votes(best) < min_votes)
+      continue;
+
+    const cv::Point seed(edges.x[p], edges.y[p]);
+    cv::Point_<double> line_polar(best.x * d_theta - max_theta,
+                                  seed.x * tables.cos_theta[best.x] + seed.y * tables.sin_theta[best.x]);
+    LineSegment segment = segment_from(size, [&](int y, int x) {
+      return remaining(y, x) >= 0;
+    }, line_polar, seed, connect_thresh);
+
+    vote(p, -1);
+    remaining(seed) = -1;
+    if (segment.end - segment.start < min_length)
+      continue;
+
+    for (int u = segment.start; u <= segment.end; ++u) {
+      cv::Point on_line = segment.at(u);
+      for (int dv = -1; dv <= 1; ++dv) {
+        cv::Point q = on_line + (segment.xy ? cv::Point(dv, 0) : cv::Point(0, dv));
+        if (q.x < 0 || q.y < 0 || q.x >= size.width || q.y >= size.height || remaining(q) < 0)
+          continue;
+        if (voted[remaining(q)])
+          vote(remaining(q), -1);
+        remaining(q) = -1;
+      }
+    }
+
+    cv::Point p0 = segment.at(segment.start), p1 = segment.at(segment.end);
+    segments.push_back(cv::Vec4i(p0.x, p0.y, p1.x, p1.y));
+  }
+  return segments;
 }
 
 @ \subsection*{Implementation of [[main]]}
 
 The implementation of the [[main]] function consists simply of loading the image and applying the hough transform and longest edge annotation on it.
 Annotations are also drawn on the hough transform graph to show locations of highest intensity.
+Both are done by [[hough_annotate]], which also returns the edges and the annotated hough transform through pointers when they are not null.
+Called as [[Q2 batch <pattern> <out_dir> [threads] [gradient]]], [[main]] instead annotates every matching image with [[run_batch]], voting only near the gradient direction if [[gradient]] is given.
+Called as [[Q2 segments <in> <out> [n] [budget_ms] [min_votes]]], it draws the segments found by [[hough_segments]] and prints how many were found and how long it took.
+
+<<[[hough_annotate]] Function>>=
+cv::Mat_<cv::Vec3b> hough_annotate(const cv::Mat_<uint8_t>& im,
+                                   cv::Mat_<uint8_t>* edges_out=nullptr,
+                                   cv::Mat_<cv::Vec3b>* hough_out=nullptr,
+                                   const bool gradient=false) {
+  EdgeList edge_list(im.size(), gradient);
+  cv::Mat_<uint8_t> edges = edge_detect(im, 0.7, nullptr, &edge_list);
+  PackedMask edge_mask = pack_mask(edges);
+
+  double max_rho;
+  cv::Mat_<uint16_t> hough = hough_transform<uint16_t>(edge_list, 600, 600, &max_rho);
+
+  cv::Mat_<cv::Vec3b> hough_display, im_display;
+  cv::Mat_<uint8_t> hough_8;
+  hough.convertTo(hough_8, cv::DataType<uint8_t>::type);
+  cv::cvtColor(in_range(hough_8), hough_display, cv::COLOR_GRAY2BGR);
+  cv::cvtColor(im, im_display, cv::COLOR_GRAY2BGR);
+
+  std::vector<cv::Point_<uint16_t> > hough_indices;
+  std::vector<cv::Point_<double> > hough_vec = hough_lines(hough, max_rho, 2,
+                                                           &hough_indices);
+  for (int i = 0; i < hough_vec.size(); ++i) {
+    cv::Point_<double> line_polar = hough_vec[i];
+    cv::Point_<uint16_t> indices = hough_indices[i];
+
+    cv::circle(hough_display, indices, 5, cv::Scalar(0,0,255), 2);
+    draw_line(&im_display, edge_mask, line_polar, 10);
+  }
+
+  if (edges_out)
+    *edges_out = edges;
+  if (hough_out)
+    *hough_out = hough_display;
+  return im_display;
+}
 
 <<Q2.cpp>>=
 <<Include>>
-<<Global constants>>
+<<[[png_write]] Function>>
 <<[[im_load]] Function>>
+<<[[parallel_rows]] Function>>
+<<[[PackedMask]] Function>>
+<<[[run_batch]] Function>>
 <<[[in_range]] Function>>
 
 <<[[edge_detect]] Function>>
@@ -199,8 +597,43 @@ Annotations are also drawn on the hough transform graph to show locations of hig
 <<[[hough_lines]] Function>>
 <<[[yline]] and [[xline]] Functions>>
 <<[[draw_line]] Function>>
+<<[[hough_segments]] Function>>
+<<[[hough_annotate]] Function>>
 
 int main(int argc, char* argv[]) {
+  <<Thread count>>
+  if (argc >= 4 && std::string("batch") == argv[1]) {
+    int threads = (argc >= 5) ? std::atoi(argv[4]) : 0;
+    bool gradient = (argc >= 6) && std::string("gradient") == argv[5];
+    return run_batch(argv[2], argv[3], threads, [=](const cv::Mat_<uint8_t>& im) -> cv::Mat {
+      return hough_annotate(im, nullptr, nullptr, gradient);
+    });
+  }
+
+  if (argc >= 4 && std::string("segments") == argv[1]) {
+    int n = (argc >= 5) ? std::atoi(argv[4]) : 10;
+    double budget_ms = (argc >= 6) ? std::atof(argv[5]) : HOUGH_BUDGET_MS;
+    int min_votes = (argc >= 7) ? std::atoi(argv[6]) : HOUGH_MIN_VOTES;
+
+    cv::Mat_<uint8_t> im;
+    if (!im_load<uint8_t>(argv[2], &im, cv::IMREAD_GRAYSCALE))
+      return 1;
+
+    EdgeList edge_list(im.size(), true);
+    edge_detect(im, 0.7, nullptr, &edge_list);
+    int64 start = cv::getTickCount();
+    std::vector<cv::Vec4i> segments = hough_segments(edge_list, n, min_votes, budget_ms);
+    std::cout << segments.size() << " segments in " << elapsed_ms(start) << " ms" << std::endl;
+
+    cv::Mat_<cv::Vec3b> im_display;
+    cv::cvtColor(im, im_display, cv::COLOR_GRAY2BGR);
+    for (int i = 0; i < segments.size(); ++i) {
+      cv::line(im_display, cv::Point(segments[i][0], segments[i][1]),
+               cv::Point(segments[i][2], segments[i][3]), cv::Scalar(0,0,255), 2);
+    }
+    return png_write(argv[3], im_display) ? 0 : 1;
+  }
+
   <<Command line args>>
 
   cv::Mat_<uint8_t> im;
@@ -209,31 +642,13 @@ int main(int argc, char* argv[]) {
   if (!read_success)
     return 1;
 
-  cv::Mat_<uint8_t> edges = edge_detect(im);
-
-  double max_rho;
-  cv::Mat_<uint16_t> hough = hough_transform<uint16_t>(edges, 600, 600, &max_rho);
-
-  cv::Mat_<cv::Vec3b> hough_display, im_display;
-  cv::Mat_<uint8_t> hough_8;
-  hough.convertTo(hough_8, cv::DataType<uint8_t>::type);
-  cv::cvtColor(in_range(hough_8), hough_display, cv::COLOR_GRAY2BGR);
-  cv::cvtColor(im, im_display, cv::COLOR_GRAY2BGR);
-
-  std::vector<cv::Point_<uint16_t> > hough_indices;
-  std::vector<cv::Point_<double> > hough_vec = hough_lines(hough, max_rho, 2,
-                                                           &hough_indices);
-  for (int i = 0; i < hough_vec.size(); ++i) {
-    cv::Point_<double> line_polar = hough_vec[i];
-    cv::Point_<uint16_t> indices = hough_indices[i];
-
-    cv::circle(hough_display, indices, 5, cv::Scalar(0,0,255), 2);
-    draw_line(&im_display, edges, line_polar, 10);
-  }
+  cv::Mat_<uint8_t> edges;
+  cv::Mat_<cv::Vec3b> hough_display;
+  cv::Mat_<cv::Vec3b> im_display = hough_annotate(im, &edges, &hough_display);
 
-  cv::imwrite(path + "/output/hough_edges.png", edges, PNG_COMPRESSION);
-  cv::imwrite(path + "/output/hough.png", hough_display, PNG_COMPRESSION);
-  cv::imwrite(path + "/output/hough_annotated.png", im_display, PNG_COMPRESSION);
+  png_write(path + "/output/hough_edges.png", edges);
+  png_write(path + "/output/hough.png", hough_display);
+  png_write(path + "/output/hough_annotated.png", im_display);
 
   if (display) {
     cv::imshow("Edges by Sobel Detector", edges);
@@ -0,0 +1,176 @@
+@ \subsection*{Batch Pipelines}
+
+The batch modes of every program run as pipelines of threads, where each stage hands its results to the next through a [[BoundedQueue]].
+The queue blocks producers when it is full, so only a few images are held in memory however many files there are.
+A queue is closed once its producers are done, after which [[pop]] fails when it runs empty, letting the consumers finish.
+
+<<[[BoundedQueue]] Function>>=
+template<typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() { return items_.size() < capacity_; });
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+  }
+
+  bool pop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+    if (items_.empty())
+      return false;
+    *item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  size_t capacity_;
+  bool closed_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_, not_full_;
+};
+
+const int BATCH_QUEUE_SIZE = 8;
+
+@ The inputs of a batch are named by a glob pattern or, if the argument ends in [[.txt]], by a manifest file with one path per line.
+Each output is named after its input without the directory or extension, so [[batch_names]] appends [[_2]], [[_3]], and so on to a name which is already taken, keeping inputs with the same name in different directories from overwriting each other's outputs.
+
+<<[[batch_inputs]] Function>>=
+std::vector<std::string> batch_inputs(const std::string& pattern) {
+  std::vector<std::string> in_paths;
+  if (pattern.size() > 4 && pattern.substr(pattern.size() - 4) == ".txt") {
+    std::ifstream manifest(pattern);
+    std::string line;
+    while (std::getline(manifest, line)) {
+      if (!line.empty())
+        in_paths.push_back(line);
+    }
+  } else {
+    std::vector<cv::String> found;
+    cv::glob(pattern, found);
+    in_paths.assign(found.begin(), found.end());
+  }
+  return in_paths;
+}
+
+std::vector<std::string> batch_names(const std::vector<std::string>& in_paths) {
+  std::vector<std::string> names;
+  std::set<std::string> taken;
+  for (const std::string& in_path : in_paths) {
+    size_t slash = in_path.find_last_of("/\\"), dot = in_path.find_last_of('.');
+    size_t name_start = (slash == std::string::npos) ? 0 : slash + 1;
+    std::string name = in_path.substr(name_start, (dot == std::string::npos || dot < name_start)
+                                                  ? std::string::npos : dot - name_start);
+    std::string unique = name;
+    for (int k = 2; !taken.insert(unique).second; ++k)
+      unique = name + "_" + std::to_string(k);
+    names.push_back(unique);
+  }
+  return names;
+}
+
+@ The [[run_batch]] function applies an operation to many greyscale images in one process, instead of starting the program once for each image.
+One thread decodes the images, a pool of [[threads]] workers applies the operation, and a smaller pool of encoders writes each result to [[out_dir]] as a PNG named by [[batch_names]], so that decoding, computing, and encoding of different images overlap.
+The operations themselves run their loops on OpenCV's thread pool, so while the workers run, the cores are split between them with [[cv::setNumThreads]] instead of each worker starting a thread for every core.
+The time spent in each stage is printed for every image.
+
+<<[[run_batch]] Function>>=
+<<[[BoundedQueue]] Function>>
+<<[[batch_inputs]] Function>>
+
+struct BatchItem {
+  std::string name;
+  cv::Mat image;
+  double decode_ms, compute_ms;
+};
+
+double elapsed_ms(int64 start) {
+  return (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+}
+
+int run_batch(const std::string& pattern, const std::string& out_dir, int threads,
+              const std::function<cv::Mat(const cv::Mat_<uint8_t>&)>& op) {
+  std::vector<std::string> in_paths = batch_inputs(pattern),
+                           names = batch_names(in_paths);
+  if (threads < 1)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  const int n_encoders = std::max(1, threads / 2);
+  const int op_threads = cv::getNumThreads();
+  cv::setNumThreads(std::max(1, op_threads / threads));
+
+  BoundedQueue<BatchItem> decoded(BATCH_QUEUE_SIZE), computed(BATCH_QUEUE_SIZE);
+  std::atomic<int> failures(0);
+  std::mutex print_lock;
+
+  std::thread decoder([&]() {
+    for (size_t i = 0; i < in_paths.size(); ++i) {
+      int64 start = cv::getTickCount();
+      BatchItem item;
+      item.name = names[i];
+      cv::Mat_<uint8_t> image;
+      if (!im_load<uint8_t>(in_paths[i], &image, cv::IMREAD_GRAYSCALE)) {
+        ++failures;
+        continue;
+      }
+      item.image = image;
+      item.decode_ms = elapsed_ms(start);
+      decoded.push(std::move(item));
+    }
+    decoded.close();
+  });
+
+  std::vector<std::thread> workers, encoders;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&]() {
+      BatchItem item;
+      while (decoded.pop(&item)) {
+        int64 start = cv::getTickCount();
+        item.image = op(item.image);
+        item.compute_ms = elapsed_ms(start);
+        if (!item.image.data) {
+          ++failures;
+          continue;
+        }
+        computed.push(std::move(item));
+      }
+    });
+  }
+  for (int t = 0; t < n_encoders; ++t) {
+    encoders.emplace_back([&]() {
+      BatchItem item;
+      while (computed.pop(&item)) {
+        int64 start = cv::getTickCount();
+        if (!png_write(out_dir + "/" + item.name + ".png", item.image))
+          ++failures;
+        double encode_ms = elapsed_ms(start);
+        std::lock_guard<std::mutex> lock(print_lock);
+        std::cout << item.name << ": decode " << item.decode_ms << " ms, compute "
+                  << item.compute_ms << " ms, encode " << encode_ms << " ms" << std::endl;
+      }
+    });
+  }
+
+  decoder.join();
+  for (std::thread& worker : workers)
+    worker.join();
+  computed.close();
+  for (std::thread& encoder : encoders)
+    encoder.join();
+  cv::setNumThreads(op_threads);
+
+  std::cout << "Processed " << in_paths.size() - failures << " of " << in_paths.size()
+            << " images" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
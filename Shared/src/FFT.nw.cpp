@@ -0,0 +1,39 @@
+@ \subsection*{Frequency Domain Engines}
+
+Correlation and convolution with large templates are both cheaper through the Fourier transform.
+To choose between a direct engine and a frequency domain engine, [[fft_cheaper]] compares a rough operation count for each.
+The direct engine costs $MN$ multiply-adds per pixel, while the frequency domain engine costs three transforms of $P \log_2 P$ operations each on the $P$ pixel transform grid.
+The constant [[FFT_COST_FACTOR]] accounts for complex arithmetic and memory traffic in each transform operation.
+
+The transforms are computed in double precision, with unit roundoff $\epsilon = 2^{-53} \approx 1.1 \times 10^{-16}$.
+Each of the three transforms adds an error of order $\epsilon \log_2 P$ relative to the norm of its input, so the error of the result is of order $3 \epsilon \log_2 P$ times the norm of the exact result.
+No sum can be larger in magnitude than $S = \max\left|I\right| \sum \left|T\right|$, so the norm of the exact result is at most $\sqrt{P} S$, and a single sum, which may take all of the error, is off by at most $3 \epsilon \log_2 P \sqrt{P} S$.
+For transform grids up to $P = 2^{26}$ pixels, $3 \epsilon \log_2 P \sqrt{P} \approx 7 \times 10^{-11}$, so every sum agrees with the direct engine to within [[FFT_TOLERANCE]]$\cdot S$, with a margin for the constant of the transform's error bound.
+For 8-bit images and normalized kernels, $S \leq 255$, so a truncated result can only differ from the direct engine by one level where its exact value lies within $2.6 \times 10^{-7}$ of an integer.
+
+If the environment variable [[CSCE590_CHECK_FFT]] is set, the engines also compute the sums directly and [[check_fft]] reports an error if any sum computed through the transform differs by more than this bound.
+
+<<[[fft_cheaper]] Function>>=
+const double FFT_COST_FACTOR = 4.0;
+const double FFT_TOLERANCE = 1e-9;
+const bool CHECK_FFT = std::getenv("CSCE590_CHECK_FFT") != nullptr;
+
+bool fft_cheaper(const cv::Size& padded_size, const cv::Size& templ_size) {
+  double dft_area = (double) cv::getOptimalDFTSize(padded_size.width)
+                    * cv::getOptimalDFTSize(padded_size.height);
+  double direct_cost = (double) padded_size.area() * templ_size.area(),
+         fft_cost = FFT_COST_FACTOR * 3 * dft_area * std::log2(dft_area);
+  return fft_cost < direct_cost;
+}
+
+bool check_fft(const cv::Mat& fft_sums, const cv::Mat& direct_sums,
+               const cv::Mat& image, const cv::Mat& templ) {
+  double bound = FFT_TOLERANCE * cv::norm(image, cv::NORM_INF) * cv::norm(templ, cv::NORM_L1);
+  double max_error = cv::norm(fft_sums, direct_sums, cv::NORM_INF);
+  if (max_error > bound) {
+    std::cerr << "ERROR: frequency domain sums differ from direct sums by " << max_error
+              << ", more than " << bound << std::endl;
+    return false;
+  }
+  return true;
+}
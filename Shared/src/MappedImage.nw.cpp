@@ -0,0 +1,149 @@
+@ \subsection*{Mapped Images}
+
+Uncompressed images do not need to be decoded, so instead of reading them through [[cv::imread]], which copies the whole file into a buffer and then into the image, a [[MappedImage]] maps the file into memory and exposes its pixels as a [[cv::Mat]] header over the mapped pages.
+It supports binary PGM and PPM images with 8 bit values, and a simple raw format written by [[save_raw]], which is a line [[RAW]] followed by a line with the width, height, and OpenCV type, and then the rows of pixels in [[cv::Mat]] order.
+The pages are mapped copy on write, so writing to the image never changes the file.
+The header is only valid while the [[MappedImage]] is open; [[to_mode]] gives the same image as [[cv::imread]] with the given mode, sharing the mapped pages when no conversion is needed.
+Like [[cv::imread]], it reduces other depths to 8 bits unless the mode includes [[cv::IMREAD_ANYDEPTH]], dividing 16 bit values by 256, and converts to one channel or three as the mode asks unless it is [[cv::IMREAD_UNCHANGED]].
+Raw images are only accepted with 8 bit, 16 bit, or float values and 1, 3, or 4 channels, and images of either format must have a positive size.
+PPM stores its channels in RGB order, which [[rgb]] reports and [[to_mode]] swaps to BGR.
+
+<<[[MappedImage]] Function>>=
+bool parse_header_ints(const char* bytes, size_t length, size_t* pos, int* values, int n) {
+  for (int k = 0; k < n; ++k) {
+    while (*pos < length && (isspace(bytes[*pos]) || bytes[*pos] == '#')) {
+      if (bytes[*pos] == '#') {
+        while (*pos < length && bytes[*pos] != '\n')
+          ++*pos;
+      } else {
+        ++*pos;
+      }
+    }
+    if (*pos >= length || !isdigit(bytes[*pos]))
+      return false;
+    values[k] = 0;
+    while (*pos < length && isdigit(bytes[*pos]))
+      values[k] = 10 * values[k] + (bytes[(*pos)++] - '0');
+  }
+  ++*pos;  // Single whitespace character before the pixel data
+  return *pos <= length;
+}
+
+class MappedImage {
+ public:
+  MappedImage() : data_(nullptr), length_(0), rgb_(false) {}
+  MappedImage(const MappedImage&) = delete;
+  MappedImage& operator=(const MappedImage&) = delete;
+  ~MappedImage() { close(); }
+
+  bool open(const std::string& im_path) {
+    close();
+    int fd = ::open(im_path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 3) {
+      ::close(fd);
+      return false;
+    }
+    length_ = st.st_size;
+    data_ = mmap(nullptr, length_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data_ == MAP_FAILED) {
+      data_ = nullptr;
+      return false;
+    }
+
+    const char* bytes = static_cast<const char*>(data_);
+    size_t pos = 3;
+    int values[3], type;
+    if (bytes[0] == 'P' && (bytes[1] == '5' || bytes[1] == '6') && isspace(bytes[2])) {
+      if (!parse_header_ints(bytes, length_, &pos, values, 3) || values[2] > 255) {
+        close();
+        return false;
+      }
+      type = (bytes[1] == '5') ? CV_8UC1 : CV_8UC3;
+      rgb_ = bytes[1] == '6';
+    } else if (length_ > 4 && std::string(bytes, 4) == "RAW\n") {
+      pos = 4;
+      if (!parse_header_ints(bytes, length_, &pos, values, 3) || values[2] > CV_64FC4
+          || (CV_MAT_DEPTH(values[2]) != CV_8U && CV_MAT_DEPTH(values[2]) != CV_16U
+              && CV_MAT_DEPTH(values[2]) != CV_32F)
+          || (CV_MAT_CN(values[2]) != 1 && CV_MAT_CN(values[2]) != 3
+              && CV_MAT_CN(values[2]) != 4)) {
+        close();
+        return false;
+      }
+      type = values[2];
+      rgb_ = false;
+    } else {
+      close();
+      return false;
+    }
+    if (values[0] <= 0 || values[1] <= 0) {
+      close();
+      return false;
+    }
+
+    cv::Mat image(values[1], values[0], type, static_cast<char*>(data_) + pos);
+    if (pos + image.total() * image.elemSize() > length_) {
+      std::cerr << "ERROR: image file " << im_path << " is truncated" << std::endl;
+      close();
+      return false;
+    }
+    mat_ = image;
+    return true;
+  }
+
+  void close() {
+    mat_.release();
+    if (data_)
+      munmap(data_, length_);
+    data_ = nullptr;
+    length_ = 0;
+  }
+
+  const cv::Mat& mat() const { return mat_; }
+  bool rgb() const { return rgb_; }
+
+  cv::Mat to_mode(int mode=cv::IMREAD_COLOR) const {
+    cv::Mat source = mat_, converted;
+    if (mode != cv::IMREAD_UNCHANGED && !(mode & cv::IMREAD_ANYDEPTH) && source.depth() != CV_8U)
+      source.convertTo(source, CV_8U, (source.depth() == CV_16U) ? 1 / 256.0 : 1);
+
+    const int channels = (mode == cv::IMREAD_UNCHANGED) ? source.channels()
+                         : (mode & cv::IMREAD_COLOR) ? 3 : 1;
+    int code = -1;
+    if (channels == 1 && source.channels() == 3)
+      code = rgb_ ? cv::COLOR_RGB2GRAY : cv::COLOR_BGR2GRAY;
+    else if (channels == 1 && source.channels() == 4)
+      code = cv::COLOR_BGRA2GRAY;
+    else if (channels == 3 && source.channels() == 1)
+      code = cv::COLOR_GRAY2BGR;
+    else if (channels == 3 && source.channels() == 4)
+      code = cv::COLOR_BGRA2BGR;
+    else if (channels == 3 && rgb_)
+      code = cv::COLOR_RGB2BGR;
+
+    if (code >= 0)
+      cv::cvtColor(source, converted, code);
+    else
+      converted = source;
+    return converted;
+  }
+
+ private:
+  void* data_;
+  size_t length_;
+  cv::Mat mat_;
+  bool rgb_;
+};
+
+bool save_raw(const std::string& out_path, const cv::Mat& mat) {
+  std::ofstream out(out_path, std::ios::binary);
+  out << "RAW\n" << mat.cols << " " << mat.rows << " " << mat.type() << "\n";
+  for (int i = 0; i < mat.rows; ++i)
+    out.write(mat.ptr<char>(i), mat.cols * mat.elemSize());
+  out.close();
+  return !out.fail();
+}
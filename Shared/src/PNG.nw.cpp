@@ -0,0 +1,67 @@
+@ \subsection*{PNG Output}
+
+Every PNG is written with [[png_write]] using the output profile chosen by the environment variable [[CSCE590_PNG_PROFILE]].
+The profiles [[uncompressed]], [[fast]], [[balanced]], and [[small]] use zlib levels 0, 1, 6, and 9; the default is [[small]], the level 9 every PNG was written with before the profiles existed.
+The [[uncompressed]] profile is meant for intermediate files which are read again by another program, where encoding time matters more than size.
+The zlib strategy can be chosen with [[CSCE590_PNG_STRATEGY]]; [[rle]] and [[huffman]] are much faster for masks and other images with few distinct values.
+A name which is not one of the profiles or strategies is reported with a warning, and the default is used instead.
+
+If [[CSCE590_PNG_TIMING]] is set, [[png_write]] also encodes each image with every profile and prints the time and size of each, so that a profile can be chosen for a given kind of output.
+
+<<[[png_write]] Function>>=
+enum OutputProfile {
+  UNCOMPRESSED = 0,
+  FAST = 1,
+  BALANCED = 2,
+  SMALL = 3
+};
+
+const std::vector<std::string> OUTPUT_PROFILES = {"uncompressed", "fast", "balanced", "small"};
+const std::vector<int> PNG_LEVELS = {0, 1, 6, 9};
+const std::vector<std::string> PNG_STRATEGIES = {"default", "filtered", "huffman", "rle", "fixed"};
+
+std::vector<int> png_params(OutputProfile profile, int strategy=cv::IMWRITE_PNG_STRATEGY_DEFAULT) {
+  return {cv::IMWRITE_PNG_COMPRESSION, PNG_LEVELS[profile], cv::IMWRITE_PNG_STRATEGY, strategy};
+}
+
+// Index of name in names, or fallback with a warning if it is not one of them
+int png_option(const char* variable, const std::vector<std::string>& names, int fallback) {
+  const char* name = std::getenv(variable);
+  if (!name)
+    return fallback;
+  for (int k = 0; k < names.size(); ++k) {
+    if (names[k] == name)
+      return k;
+  }
+  std::cerr << "WARNING: unknown " << variable << " `" << name << "`, using `"
+            << names[fallback] << "`" << std::endl;
+  return fallback;
+}
+
+std::vector<int> png_params_from_env() {
+  OutputProfile profile = (OutputProfile) png_option("CSCE590_PNG_PROFILE", OUTPUT_PROFILES,
+                                                     OutputProfile::SMALL);
+  // Same order as cv::IMWRITE_PNG_STRATEGY_*
+  int strategy = png_option("CSCE590_PNG_STRATEGY", PNG_STRATEGIES,
+                            cv::IMWRITE_PNG_STRATEGY_DEFAULT);
+  return png_params(profile, strategy);
+}
+
+const std::vector<int> PNG_PARAMS = png_params_from_env();
+
+void png_profile_report(const std::string& out_path, const cv::Mat& image) {
+  std::vector<uchar> buffer;
+  for (int k = 0; k < OUTPUT_PROFILES.size(); ++k) {
+    int64 start = cv::getTickCount();
+    cv::imencode(".png", image, buffer, png_params((OutputProfile) k));
+    double ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+    std::cout << out_path << " " << OUTPUT_PROFILES[k] << ": " << buffer.size()
+              << " bytes in " << ms << " ms" << std::endl;
+  }
+}
+
+bool png_write(const std::string& out_path, const cv::Mat& image) {
+  if (std::getenv("CSCE590_PNG_TIMING"))
+    png_profile_report(out_path, image);
+  return cv::imwrite(out_path, image, PNG_PARAMS);
+}
@@ -0,0 +1,78 @@
+@ \subsection*{Packed Masks}
+
+A [[PackedMask]] stores a binary image with one bit per pixel, eight times less memory than an 8 bit image, for the stages of a pipeline which only need to know whether a pixel is set.
+Each row starts on a new byte, and bit $k$ of byte $b$ of a row holds the pixel in column $8b + k$.
+
+The [[threshold_packed]] function sets the bits of the pixels at or above a threshold, and [[pack_mask]] those of the nonzero pixels of an 8 bit image.
+The [[unpack_mask]] function expands a mask back to an 8 bit image of 255 and 0, for writing it out.
+For 8 bit images, sixteen pixels are compared at once and [[v_signmask]] gathers the top bit of each comparison into the two bytes of output, in the same order as the mask; the rest of the row, and every row when OpenCV is built without SIMD support, is packed eight pixels to a byte.
+
+<<[[PackedMask]] Function>>=
+struct PackedMask {
+  PackedMask() : rows(0), cols(0), stride(0) {}
+  PackedMask(int rows, int cols)
+      : rows(rows), cols(cols), stride((cols + 7) / 8), bits(rows * stride, 0) {}
+
+  bool operator()(int y, int x) const { return (bits[y * stride + (x >> 3)] >> (x & 7)) & 1; }
+  void set(int y, int x) { bits[y * stride + (x >> 3)] |= 1 << (x & 7); }
+  uint8_t* row(int y) { return &bits[y * stride]; }
+  const uint8_t* row(int y) const { return &bits[y * stride]; }
+  cv::Size size() const { return cv::Size(cols, rows); }
+
+  int rows, cols, stride;
+  std::vector<uint8_t> bits;
+};
+
+// Packs the first bytes of a row with SIMD and returns how many bytes were written
+template <typename T>
+int threshold_packed_simd(const T* in, T threshold, uint8_t* out, int cols) {
+  return 0;
+}
+
+#if CV_SIMD128
+inline int threshold_packed_simd(const uint8_t* in, uint8_t threshold, uint8_t* out, int cols) {
+  const cv::v_uint8x16 thresh = cv::v_setall_u8(threshold);
+  int b = 0;
+  for (; 8 * b + 16 <= cols; b += 2) {
+    int bits = cv::v_signmask(cv::v_load(in + 8 * b) >= thresh);
+    out[b] = bits & 0xff;
+    out[b + 1] = bits >> 8;
+  }
+  return b;
+}
+#endif
+
+template <typename T>
+PackedMask threshold_packed(const cv::Mat_<T>& mat, T threshold) {
+  PackedMask mask(mat.rows, mat.cols);
+  parallel_rows(mat.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      const T* in = mat[y];
+      uint8_t* out = mask.row(y);
+      for (int b = threshold_packed_simd(in, threshold, out, mat.cols); b < mask.stride; ++b) {
+        uint8_t byte = 0;
+        for (int k = 0; k < 8 && 8 * b + k < mat.cols; ++k)
+          byte |= (in[8 * b + k] >= threshold) << k;
+        out[b] = byte;
+      }
+    }
+  });
+  return mask;
+}
+
+PackedMask pack_mask(const cv::Mat_<uint8_t>& mat) {
+  return threshold_packed<uint8_t>(mat, 1);
+}
+
+cv::Mat_<uint8_t> unpack_mask(const PackedMask& mask) {
+  cv::Mat_<uint8_t> mat(mask.size());
+  parallel_rows(mask.rows, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      const uint8_t* bits = mask.row(y);
+      uint8_t* out = mat[y];
+      for (int x = 0; x < mask.cols; ++x)
+        out[x] = ((bits[x >> 3] >> (x & 7)) & 1) ? 255 : 0;
+    }
+  });
+  return mat;
+}
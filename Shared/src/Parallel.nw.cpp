@@ -0,0 +1,24 @@
+@ \subsection*{Parallel Rows}
+
+The [[parallel_rows]] function runs a loop over image rows on all available threads with [[cv::parallel_for_]].
+The rows are split into contiguous stripes, and [[body]] is called with the first and one past the last row of each stripe.
+Each row is written by exactly one stripe, so the output does not depend on the number of threads.
+The number of threads defaults to the number of cores and can be set with the environment variable [[CSCE590_THREADS]], which every [[main]] applies before choosing its mode.
+OpenCV chooses the number of stripes unless [[stripes]] is given, which a body that costs the same whatever the size of its stripe uses to get one stripe per thread.
+
+<<[[parallel_rows]] Function>>=
+class ParallelRows : public cv::ParallelLoopBody {
+ public:
+  explicit ParallelRows(const std::function<void(int, int)>& body) : body_(body) {}
+  void operator()(const cv::Range& range) const {
+    body_(range.start, range.end);
+  }
+
+ private:
+  std::function<void(int, int)> body_;
+};
+
+void parallel_rows(const int rows, const std::function<void(int, int)>& body,
+                   const int stripes=-1) {
+  cv::parallel_for_(cv::Range(0, rows), ParallelRows(body), stripes);
+}
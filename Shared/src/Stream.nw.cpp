@@ -0,0 +1,181 @@
+@ \subsection*{Streaming Bands}
+
+The [[stream_bands]] function runs an operator over an image which may be too large to hold in memory.
+The input is read in bands of [[band_rows]] rows, each extended by [[halo]] rows above and below so that an operator whose output row depends on the input rows within [[halo]] of it produces the same rows as on the whole image.
+Only the rows without halo are kept from the result of each band and written out right away, so at most one band and its halo are held in memory at a time.
+
+Binary PGM and PPM files are read and written one band at a time by [[BandReader]] and [[BandWriter]].
+If such a file ends before all of its rows are read, [[BandReader]] returns an empty band and [[stream_bands]] stops and reports failure.
+Other formats cannot be decoded partially by OpenCV, so they are loaded with [[cv::imread]] and saved with [[cv::imwrite]] as a whole; the results are the same, but memory is no longer bounded.
+PPM stores its channels in RGB order, which is swapped to match the BGR order of [[cv::imread]].
+
+<<[[stream_bands]] Function>>=
+const int STREAM_BAND_ROWS = 256;
+
+bool read_pnm_header(std::ifstream& in, char* format, cv::Size* size, int* max_value) {
+  char magic[2];
+  if (!in.read(magic, 2) || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6'))
+    return false;
+  *format = magic[1];
+
+  int values[3];
+  for (int k = 0; k < 3; ++k) {
+    in >> std::ws;
+    while (in.peek() == '#') {
+      in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+      in >> std::ws;
+    }
+    if (!(in >> values[k]))
+      return false;
+  }
+  in.get();  // Single whitespace character before the pixel data
+  *size = cv::Size(values[0], values[1]);
+  *max_value = values[2];
+  return true;
+}
+
+class BandReader {
+ public:
+  BandReader(const std::string& im_path, int mode=cv::IMREAD_COLOR) : rows_read_(0) {
+    int channels = (mode == cv::IMREAD_GRAYSCALE) ? 1 : 3;
+    type_ = CV_8UC(channels);
+
+    char format;
+    int max_value;
+    in_.open(im_path, std::ios::binary);
+    streaming_ = in_ && read_pnm_header(in_, &format, &size_, &max_value)
+                 && max_value < 256 && (format == '5' ? 1 : 3) == channels;
+    if (!streaming_) {
+      in_.close();
+      whole_ = cv::imread(im_path, mode);
+      size_ = whole_.size();
+      if (!whole_.data)
+        std::cout << "Failed to read image " << im_path << std::endl;
+    }
+  }
+
+  bool good() const { return streaming_ || whole_.data; }
+  cv::Size size() const { return size_; }
+  int type() const { return type_; }
+
+  cv::Mat read(int count) {
+    count = std::min(count, size_.height - rows_read_);
+    cv::Mat rows;
+    if (streaming_) {
+      rows.create(count, size_.width, type_);
+      if (count > 0) {
+        if (!in_.read(rows.ptr<char>(), rows.total() * rows.elemSize())) {
+          std::cerr << "ERROR: image ended after " << rows_read_ << " rows" << std::endl;
+          return cv::Mat();
+        }
+        if (type_ == CV_8UC3)
+          cv::cvtColor(rows, rows, cv::COLOR_RGB2BGR);
+      }
+    } else {
+      rows = whole_.rowRange(rows_read_, rows_read_ + count);
+    }
+    rows_read_ += count;
+    return rows;
+  }
+
+ private:
+  std::ifstream in_;
+  cv::Mat whole_;
+  cv::Size size_;
+  int type_;
+  int rows_read_;
+  bool streaming_;
+};
+
+class BandWriter {
+ public:
+  BandWriter() : rows_written_(0), streaming_(false) {}
+
+  void open(const std::string& out_path, cv::Size size, int type) {
+    out_path_ = out_path;
+    std::string ext = out_path.substr(out_path.find_last_of('.') + 1);
+    streaming_ = (ext == "pgm" && type == CV_8UC1) || (ext == "ppm" && type == CV_8UC3);
+    if (streaming_) {
+      out_.open(out_path, std::ios::binary);
+      out_ << (type == CV_8UC1 ? "P5" : "P6") << "\n"
+           << size.width << " " << size.height << "\n255\n";
+    } else {
+      whole_.create(size, type);
+    }
+  }
+
+  bool is_open() const { return streaming_ ? out_.is_open() : !whole_.empty(); }
+
+  void write(const cv::Mat& rows) {
+    if (streaming_) {
+      cv::Mat ordered = rows;
+      if (rows.channels() == 3)
+        cv::cvtColor(rows, ordered, cv::COLOR_BGR2RGB);
+      for (int i = 0; i < ordered.rows; ++i)
+        out_.write(ordered.ptr<char>(i), ordered.cols * ordered.elemSize());
+    } else {
+      rows.copyTo(whole_.rowRange(rows_written_, rows_written_ + rows.rows));
+    }
+    rows_written_ += rows.rows;
+  }
+
+  bool close() {
+    if (streaming_) {
+      out_.close();
+      return !out_.fail();
+    }
+    return cv::imwrite(out_path_, whole_);
+  }
+
+ private:
+  std::string out_path_;
+  std::ofstream out_;
+  cv::Mat whole_;
+  int rows_written_;
+  bool streaming_;
+};
+
+bool stream_bands(const std::string& in_path, const std::string& out_path, int mode,
+                  int band_rows, int halo, const std::function<cv::Mat(const cv::Mat&)>& op) {
+  BandReader reader(in_path, mode);
+  if (!reader.good())
+    return false;
+  if (band_rows < 1) {
+    std::cerr << "ERROR: band must have at least one row" << std::endl;
+    return false;
+  }
+
+  const int height = reader.size().height;
+  BandWriter writer;
+  cv::Mat window;  // Input rows [window_top, window_top + window.rows)
+  int window_top = 0;
+  for (int out_top = 0; out_top < height; out_top += band_rows) {
+    int out_bottom = std::min(height, out_top + band_rows);
+    int need_top = std::max(0, out_top - halo),
+        need_bottom = std::min(height, out_bottom + halo);
+
+    // Keep the overlap with the previous window and read the rest
+    int read_so_far = window_top + window.rows,
+        keep = read_so_far - need_top;
+    cv::Mat next(need_bottom - need_top, reader.size().width, reader.type());
+    if (keep > 0)
+      window.rowRange(window.rows - keep, window.rows).copyTo(next.rowRange(0, keep));
+    cv::Mat fresh = reader.read(need_bottom - read_so_far);
+    if (fresh.rows < need_bottom - read_so_far)
+      return false;
+    if (fresh.rows > 0)
+      fresh.copyTo(next.rowRange(keep, next.rows));
+    window = next;
+    window_top = need_top;
+
+    cv::Mat result = op(window);
+    if (result.rows != window.rows) {
+      std::cerr << "ERROR: streamed operator must keep the number of rows" << std::endl;
+      return false;
+    }
+    if (!writer.is_open())
+      writer.open(out_path, cv::Size(result.cols, height), result.type());
+    writer.write(result.rowRange(out_top - window_top, out_bottom - window_top));
+  }
+  return writer.is_open() && writer.close();
+}